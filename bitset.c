@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "bitset.h"
+
+// Dense sets of small integers, one bit each, that can be combined a word
+// at a time.
+
+size_t
+bswords(const size_t n)
+{
+	return (n + 63) / 64;
+}
+
+uint64_t *
+bsalloc(const size_t words)
+{
+	return xcalloc(words ? words : 1, sizeof(uint64_t));
+}
+
+void
+bsset(uint64_t *const set, const size_t i)
+{
+	set[i / 64] |= UINT64_C(1) << (i % 64);
+}
+
+void
+bsclear(uint64_t *const set, const size_t i)
+{
+	set[i / 64] &= ~(UINT64_C(1) << (i % 64));
+}
+
+bool
+bstest(const uint64_t *const set, const size_t i)
+{
+	return set[i / 64] >> (i % 64) & 1;
+}
+
+// dest |= src, returning whether dest changed
+bool
+bsunion(uint64_t *const dest, const uint64_t *const src, const size_t words)
+{
+	uint64_t changed = 0;
+	for (size_t i = 0; i < words; i++) {
+		changed |= src[i] & ~dest[i];
+		dest[i] |= src[i];
+	}
+
+	return changed != 0;
+}
+
+// dest &= ~src
+void
+bsdiff(uint64_t *const dest, const uint64_t *const src, const size_t words)
+{
+	for (size_t i = 0; i < words; i++)
+		dest[i] &= ~src[i];
+}
+
+void
+bscopy(uint64_t *const dest, const uint64_t *const src, const size_t words)
+{
+	memcpy(dest, src, words * sizeof(*dest));
+}
+
+// the first element of the set that is at least i, or BSNONE
+size_t
+bsnext(const uint64_t *const set, const size_t words, const size_t i)
+{
+	size_t w = i / 64;
+	if (w >= words)
+		return BSNONE;
+
+	uint64_t word = set[w] & (~UINT64_C(0) << (i % 64));
+	while (!word) {
+		if (++w == words)
+			return BSNONE;
+		word = set[w];
+	}
+
+	return 64*w + __builtin_ctzll(word);
+}
@@ -0,0 +1,11 @@
+#define BSNONE SIZE_MAX
+
+size_t bswords(const size_t n);
+uint64_t *bsalloc(const size_t words);
+void bsset(uint64_t *const set, const size_t i);
+void bsclear(uint64_t *const set, const size_t i);
+bool bstest(const uint64_t *const set, const size_t i);
+bool bsunion(uint64_t *const dest, const uint64_t *const src, const size_t words);
+void bsdiff(uint64_t *const dest, const uint64_t *const src, const size_t words);
+void bscopy(uint64_t *const dest, const uint64_t *const src, const size_t words);
+size_t bsnext(const uint64_t *const set, const size_t words, const size_t i);
@@ -0,0 +1,414 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "bitset.h"
+#include "cfg.h"
+
+// number of records making up the instruction starting at i
+size_t
+inslen(const struct iproc *const proc, const size_t i)
+{
+	const struct instr *const ins = &proc->data[i];
+	size_t n;
+
+	switch (ins->op) {
+	case IR_NONE:
+		return ins->val;
+	case IR_ASSIGN:
+		assert(i + 1 < proc->len);
+		switch (ins[1].op) {
+		case IR_ADD:
+		case IR_CEQ:
+			return 3;
+		case IR_SELECT:
+			return 4;
+		case IR_PHI:
+			return 2 + 2*ins[1].val;
+		default:
+			return 2;
+		}
+	case IR_STORE:
+	case IR_CONDJUMP:
+		return 2;
+	case IR_CALL:
+		for (n = 1; i + n < proc->len && ins[n].op == IR_CALLARG; n++)
+			;
+		return n;
+	default:
+		return 1;
+	}
+}
+
+// the operation performed by the instruction, looking through IR_ASSIGN
+int
+insop(const struct instr *const ins)
+{
+	return ins->op == IR_ASSIGN ? ins[1].op : ins->op;
+}
+
+// Turn the instruction starting at i into a tombstone, which is dropped
+// the next time the CFG is built.
+void
+inskill(struct iproc *const proc, const size_t i)
+{
+	const size_t len = inslen(proc, i);
+	proc->data[i] = (struct instr){ .op = IR_NONE, .val = len, .valtype = VT_EMPTY };
+	for (size_t j = 1; j < len; j++)
+		proc->data[i + j] = (struct instr){ .op = IR_NONE, .val = 1, .valtype = VT_EMPTY };
+}
+
+uint64_t
+newlabel(struct iproc *const proc)
+{
+	uint64_t temp;
+	array_addlit((&proc->labels), 0);
+	return proc->labels.len - 1;
+}
+
+uint64_t
+newtemp(struct iproc *const proc, const uint8_t size, const int flags)
+{
+	struct temp temp = { .size = size, .flags = flags };
+	array_add((&proc->temps), temp);
+	return proc->temps.len - 1;
+}
+
+static bool
+isterminator(const int op)
+{
+	return op == IR_JUMP || op == IR_CONDJUMP || op == IR_RETURN;
+}
+
+// Drop tombstones and make sure that every basic block starts with a label,
+// so that blocks can always be named by their label.
+static void
+normalize(struct iproc *const proc)
+{
+	struct {
+		size_t len, cap;
+		struct instr *data;
+	} out = { 0 };
+	bool boundary = true;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		const struct instr *const ins = &proc->data[i];
+		if (ins->op == IR_NONE)
+			continue;
+
+		if (boundary && ins->op != IR_LABEL) {
+			const struct instr label = { .op = IR_LABEL, .val = newlabel(proc), .valtype = VT_LABEL };
+			array_add((&out), label);
+		}
+
+		array_push((&out), ins, inslen(proc, i));
+		boundary = isterminator(ins->op);
+	}
+
+	free(proc->data);
+	proc->data = out.data;
+	proc->len = out.len;
+	proc->cap = out.cap;
+}
+
+uint64_t
+labelblock(const struct iproc *const proc, const uint64_t label)
+{
+	const uint64_t pos = proc->labels.data[label];
+	size_t lo = 0, hi = proc->blocks.len;
+
+	while (hi - lo > 1) {
+		const size_t mid = (lo + hi) / 2;
+		if (proc->blocks.data[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	assert(proc->blocks.data[lo].label == label);
+	return lo;
+}
+
+// start of the last instruction in block b
+uint64_t
+blocklast(const struct iproc *const proc, const uint64_t b)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	uint64_t last = block->start;
+
+	for (size_t i = block->start; i < block->end; i += inslen(proc, i))
+		last = i;
+
+	return last;
+}
+
+// the first instruction from i on that isn't a label
+static size_t
+skiplabels(const struct iproc *const proc, size_t i)
+{
+	while (i < proc->len && proc->data[i].op == IR_LABEL)
+		i++;
+
+	return i;
+}
+
+// whether the procedure returns right after the instruction at i, either
+// directly or by jumping to a block that does nothing else
+bool
+returnsafter(const struct iproc *const proc, const size_t i)
+{
+	const size_t next = skiplabels(proc, i + inslen(proc, i));
+	if (next >= proc->len)
+		return false;
+
+	if (proc->data[next].op == IR_RETURN)
+		return true;
+
+	if (proc->data[next].op != IR_JUMP)
+		return false;
+
+	const uint64_t to = skiplabels(proc, proc->labels.data[proc->data[next].val]);
+	return to < proc->len && proc->data[to].op == IR_RETURN;
+}
+
+static void
+addedge(struct iproc *const proc, const uint64_t from, const uint64_t to)
+{
+	array_add((&proc->blocks.data[from].succs), to);
+	array_add((&proc->blocks.data[to].preds), from);
+}
+
+static void
+postorder(struct iproc *const proc, const uint64_t b, bool *const seen)
+{
+	seen[b] = true;
+	struct bblock *const block = &proc->blocks.data[b];
+	for (size_t i = 0; i < block->succs.len; i++) {
+		if (!seen[block->succs.data[i]])
+			postorder(proc, block->succs.data[i], seen);
+	}
+
+	array_add((&proc->order), b);
+}
+
+static uint64_t
+intersect(const struct iproc *const proc, uint64_t a, uint64_t b)
+{
+	while (a != b) {
+		while (proc->blocks.data[a].rpo > proc->blocks.data[b].rpo)
+			a = proc->blocks.data[a].idom;
+		while (proc->blocks.data[b].rpo > proc->blocks.data[a].rpo)
+			b = proc->blocks.data[b].idom;
+	}
+
+	return a;
+}
+
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy
+static void
+dominators(struct iproc *const proc)
+{
+	bool *const seen = xcalloc(proc->blocks.len, sizeof(*seen));
+	postorder(proc, 0, seen);
+	free(seen);
+
+	// reverse to get reverse postorder
+	for (size_t i = 0; i < proc->order.len / 2; i++) {
+		const uint64_t tmp = proc->order.data[i];
+		proc->order.data[i] = proc->order.data[proc->order.len - i - 1];
+		proc->order.data[proc->order.len - i - 1] = tmp;
+	}
+
+	for (size_t i = 0; i < proc->order.len; i++)
+		proc->blocks.data[proc->order.data[i]].rpo = i;
+
+	proc->blocks.data[0].idom = 0;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = 1; i < proc->order.len; i++) {
+			struct bblock *const block = &proc->blocks.data[proc->order.data[i]];
+			uint64_t idom = NOBLOCK;
+			for (size_t j = 0; j < block->preds.len; j++) {
+				const uint64_t pred = block->preds.data[j];
+				if (proc->blocks.data[pred].idom == NOBLOCK)
+					continue;
+
+				idom = idom == NOBLOCK ? pred : intersect(proc, pred, idom);
+			}
+
+			if (block->idom != idom) {
+				block->idom = idom;
+				changed = true;
+			}
+		}
+	}
+
+	for (size_t i = 1; i < proc->order.len; i++) {
+		const uint64_t b = proc->order.data[i];
+		array_add((&proc->blocks.data[proc->blocks.data[b].idom].kids), b);
+	}
+}
+
+bool
+dominates(const struct iproc *const proc, const uint64_t a, uint64_t b)
+{
+	if (proc->blocks.data[b].rpo == NOBLOCK)
+		return true;
+
+	while (b != a && b != 0)
+		b = proc->blocks.data[b].idom;
+
+	return b == a;
+}
+
+// Every back edge, going to a block that dominates its source, closes a
+// natural loop made of the blocks that reach the source without passing
+// through the header.
+static void
+loopdepths(struct iproc *const proc)
+{
+	bool *const inloop = xcalloc(proc->blocks.len, sizeof(*inloop));
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} work = { 0 };
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (block->rpo == NOBLOCK)
+			continue;
+
+		for (size_t j = 0; j < block->succs.len; j++) {
+			const uint64_t header = block->succs.data[j];
+			if (!dominates(proc, header, b))
+				continue;
+
+			memset(inloop, 0, proc->blocks.len * sizeof(*inloop));
+			inloop[header] = true;
+			work.len = 0;
+			array_add((&work), b);
+			while (work.len) {
+				const uint64_t cur = work.data[--work.len];
+				if (inloop[cur])
+					continue;
+
+				inloop[cur] = true;
+				const struct bblock *const curblock = &proc->blocks.data[cur];
+				for (size_t k = 0; k < curblock->preds.len; k++)
+					array_add((&work), curblock->preds.data[k]);
+			}
+
+			for (size_t k = 0; k < proc->blocks.len; k++)
+				proc->blocks.data[k].depth += inloop[k];
+		}
+	}
+
+	free(work.data);
+	free(inloop);
+}
+
+// The blocks of the natural loops with header h: those that reach one of
+// its back edges without going through h.
+uint64_t *
+loopbody(const struct iproc *const proc, const uint64_t h)
+{
+	const size_t words = bswords(proc->blocks.len);
+	uint64_t *const body = bsalloc(words);
+	const struct bblock *const header = &proc->blocks.data[h];
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} work = { 0 };
+
+	bsset(body, h);
+	for (size_t j = 0; j < header->preds.len; j++) {
+		const uint64_t pred = header->preds.data[j];
+		if (proc->blocks.data[pred].rpo != NOBLOCK && dominates(proc, h, pred))
+			array_add((&work), pred);
+	}
+
+	while (work.len) {
+		const uint64_t b = work.data[--work.len];
+		if (bstest(body, b))
+			continue;
+
+		bsset(body, b);
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t j = 0; j < block->preds.len; j++) {
+			if (proc->blocks.data[block->preds.data[j]].rpo != NOBLOCK)
+				array_add((&work), block->preds.data[j]);
+		}
+	}
+
+	free(work.data);
+	return body;
+}
+
+// Rebuild the basic blocks, their edges and the dominator tree after the
+// instructions were changed.
+void
+buildcfg(struct iproc *const proc)
+{
+	normalize(proc);
+
+	for (size_t i = 0; i < proc->blocks.len; i++) {
+		free(proc->blocks.data[i].preds.data);
+		free(proc->blocks.data[i].succs.data);
+		free(proc->blocks.data[i].kids.data);
+	}
+	proc->blocks.len = 0;
+	proc->order.len = 0;
+
+	for (size_t i = 0; i < proc->labels.len; i++)
+		proc->labels.data[i] = NOBLOCK;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op != IR_LABEL)
+			continue;
+
+		struct bblock block = {
+			.label = proc->data[i].val,
+			.start = i,
+			.end = proc->len,
+			.idom = NOBLOCK,
+			.rpo = NOBLOCK,
+		};
+
+		if (proc->blocks.len)
+			proc->blocks.data[proc->blocks.len - 1].end = i;
+
+		proc->labels.data[block.label] = i;
+		array_add((&proc->blocks), block);
+	}
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct instr *const last = &proc->data[blocklast(proc, b)];
+		switch (last->op) {
+		case IR_RETURN:
+			break;
+		case IR_JUMP:
+			addedge(proc, b, labelblock(proc, last->val));
+			break;
+		case IR_CONDJUMP:
+			// the fallthrough edge always comes first
+			assert(b + 1 < proc->blocks.len);
+			addedge(proc, b, b + 1);
+			addedge(proc, b, labelblock(proc, last->val));
+			break;
+		default:
+			if (b + 1 < proc->blocks.len)
+				addedge(proc, b, b + 1);
+		}
+	}
+
+	dominators(proc);
+	loopdepths(proc);
+}
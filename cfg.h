@@ -0,0 +1,11 @@
+size_t inslen(const struct iproc *const proc, const size_t i);
+int insop(const struct instr *const ins);
+void inskill(struct iproc *const proc, const size_t i);
+uint64_t newlabel(struct iproc *const proc);
+uint64_t newtemp(struct iproc *const proc, const uint8_t size, const int flags);
+uint64_t labelblock(const struct iproc *const proc, const uint64_t label);
+uint64_t blocklast(const struct iproc *const proc, const uint64_t b);
+bool returnsafter(const struct iproc *const proc, const size_t i);
+bool dominates(const struct iproc *const proc, const uint64_t a, uint64_t b);
+uint64_t *loopbody(const struct iproc *const proc, const uint64_t h);
+void buildcfg(struct iproc *const proc);
@@ -0,0 +1,341 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "dce.h"
+
+#define NOPOS UINT64_MAX
+
+#define SYS_EXIT 60
+#define SYS_EXIT_GROUP 231
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+static void
+replace(struct iproc *const proc, struct code *const code)
+{
+	free(proc->data);
+	proc->data = code->data;
+	proc->len = code->len;
+	proc->cap = code->cap;
+}
+
+// offset of the definition of each temporary
+static uint64_t *
+definitions(const struct iproc *const proc)
+{
+	uint64_t *const def = xmalloc(proc->temps.len * sizeof(*def));
+
+	for (size_t t = 0; t < proc->temps.len; t++)
+		def[t] = NOPOS;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_ASSIGN)
+			def[proc->data[i].val] = i;
+	}
+
+	return def;
+}
+
+// whether the call at i is one to exit or exit_group, which never returns
+static bool
+isexit(const struct iproc *const proc, const uint64_t *const def, const size_t i)
+{
+	const struct instr *const ins = &proc->data[i];
+	const size_t len = inslen(proc, i);
+
+	if (slice_cmplit(&toplevel.code.data[ins->val].s, "syscall") != 0 || len < 3)
+		return false;
+
+	// the arguments are listed last to first, so the number is at the end
+	const uint64_t d = def[ins[len - 1].val];
+	if (d == NOPOS || proc->data[d + 1].op != IR_IMM)
+		return false;
+
+	return proc->data[d + 1].val == SYS_EXIT || proc->data[d + 1].val == SYS_EXIT_GROUP;
+}
+
+// Nothing after a call to exit ever runs, so end its block there. What
+// follows becomes a block of its own that nothing jumps to.
+static bool
+cutexits(struct iproc *const proc)
+{
+	uint64_t *const def = definitions(proc);
+	struct code code = { 0 };
+	bool changed = false;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		array_push((&code), &proc->data[i], inslen(proc, i));
+		if (proc->data[i].op != IR_CALL || !isexit(proc, def, i))
+			continue;
+
+		const size_t next = i + inslen(proc, i);
+		if (next < proc->len && proc->data[next].op == IR_RETURN)
+			continue;
+
+		const struct instr ret = { .op = IR_RETURN, .valtype = VT_EMPTY };
+		array_add((&code), ret);
+		changed = true;
+	}
+
+	free(def);
+	if (changed)
+		replace(proc, &code);
+	else
+		free(code.data);
+
+	return changed;
+}
+
+// whether the phis of block b still get a value from the block labelled
+// 'label': it has to be reachable, and still go to b
+static bool
+flowsfrom(const struct iproc *const proc, const uint64_t b, const uint64_t label)
+{
+	const uint64_t from = labelblock(proc, label);
+	const struct bblock *const block = &proc->blocks.data[b];
+
+	if (proc->blocks.data[from].rpo == NOBLOCK)
+		return false;
+
+	for (size_t j = 0; j < block->preds.len; j++) {
+		if (block->preds.data[j] == from)
+			return true;
+	}
+
+	return false;
+}
+
+// Drop the blocks that can't be reached, along with the values phis
+// receive from them or from blocks that don't go to them anymore. A phi
+// left with a single value is just a copy.
+static bool
+dropunreachable(struct iproc *const proc)
+{
+	struct code code = { 0 };
+	bool changed = false;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (block->rpo == NOBLOCK) {
+			changed = true;
+			continue;
+		}
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const struct instr *const ins = &proc->data[i];
+			if (ins->op != IR_ASSIGN || ins[1].op != IR_PHI) {
+				array_push((&code), ins, inslen(proc, i));
+				continue;
+			}
+
+			size_t n = 0;
+			for (size_t j = 0; j < ins[1].val; j++)
+				n += flowsfrom(proc, b, ins[2 + 2*j].val);
+
+			if (n == ins[1].val) {
+				array_push((&code), ins, inslen(proc, i));
+				continue;
+			}
+
+			changed = true;
+			array_push((&code), ins, 1);
+			if (n == 1) {
+				for (size_t j = 0; j < ins[1].val; j++) {
+					if (!flowsfrom(proc, b, ins[2 + 2*j].val))
+						continue;
+
+					const struct instr copy = { .op = IR_COPY, .val = ins[3 + 2*j].val, .valtype = VT_TEMP };
+					array_add((&code), copy);
+				}
+				continue;
+			}
+
+			const struct instr phi = { .op = IR_PHI, .val = n, .valtype = VT_IMM };
+			array_add((&code), phi);
+			for (size_t j = 0; j < ins[1].val; j++) {
+				if (flowsfrom(proc, b, ins[2 + 2*j].val))
+					array_push((&code), &ins[2 + 2*j], 2);
+			}
+		}
+	}
+
+	if (changed)
+		replace(proc, &code);
+	else
+		free(code.data);
+
+	return changed;
+}
+
+// Memory that is written but never read doesn't need the writes. This is
+// mostly the place a call puts a result nobody asked for: it still has to
+// point somewhere, but a single allocation at the start will do for all of
+// them.
+static void
+writeonly(struct iproc *const proc)
+{
+	uint64_t *const def = definitions(proc);
+	bool *const read = xcalloc(proc->temps.len, sizeof(*read));
+	uint64_t shared = 0;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		const size_t len = inslen(proc, i);
+		for (size_t j = i; j < i + len; j++) {
+			const struct instr *const ins = &proc->data[j];
+			if (ins->valtype != VT_TEMP || ins->op == IR_ASSIGN)
+				continue;
+
+			// being stored to, or being where a call puts its result
+			if (j == i + 1 && (proc->data[i].op == IR_STORE || proc->data[i].op == IR_CALL))
+				continue;
+
+			read[ins->val] = true;
+		}
+	}
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		struct instr *const ins = &proc->data[i];
+		if ((ins->op != IR_STORE && ins->op != IR_CALL) || inslen(proc, i) < 2)
+			continue;
+
+		const uint64_t t = ins[1].val, d = def[t];
+		if (read[t] || d == NOPOS || proc->data[d + 1].op != IR_ALLOC)
+			continue;
+
+		if (ins->op == IR_STORE) {
+			inskill(proc, i);
+		} else if (proc->data[d + 1].val == 1) {
+			if (!shared)
+				shared = newtemp(proc, 8, TF_PTR);
+			ins[1].val = shared;
+		}
+	}
+
+	if (shared) {
+		struct code code = { 0 };
+		const struct instr alloc[] = {
+			{ .op = IR_ASSIGN, .val = shared, .valtype = VT_TEMP },
+			{ .op = IR_ALLOC, .val = 1, .valtype = VT_IMM },
+		};
+
+		assert(proc->data[0].op == IR_LABEL);
+		array_push((&code), proc->data, 1);
+		array_push((&code), alloc, 2);
+		array_push((&code), &proc->data[1], proc->len - 1);
+		replace(proc, &code);
+	}
+
+	free(read);
+	free(def);
+}
+
+// A store to the same address as a later one in the same block is dead if
+// nothing in between could have read it.
+static void
+overwritten(struct iproc *const proc)
+{
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const struct instr *const ins = &proc->data[i];
+			if (ins->op != IR_STORE)
+				continue;
+
+			for (size_t j = i + 2; j < block->end; j += inslen(proc, j)) {
+				const int op = insop(&proc->data[j]);
+				if (op == IR_LOAD || op == IR_CALL)
+					break;
+
+				if (op == IR_STORE && proc->data[j + 1].val == ins[1].val) {
+					inskill(proc, i);
+					break;
+				}
+			}
+		}
+	}
+}
+
+static bool
+haseffect(const int op)
+{
+	switch (op) {
+	case IR_STORE:
+	case IR_CALL:
+	case IR_RETURN:
+	case IR_LABEL:
+	case IR_JUMP:
+	case IR_CONDJUMP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Mark everything instructions with side effects depend on, transitively,
+// and remove every computation that wasn't marked.
+static void
+unused(struct iproc *const proc)
+{
+	uint64_t *const def = definitions(proc);
+	bool *const live = xcalloc(proc->temps.len, sizeof(*live));
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} work = { 0 };
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (haseffect(proc->data[i].op))
+			array_add((&work), i);
+	}
+
+	while (work.len) {
+		const uint64_t i = work.data[--work.len];
+		const size_t len = inslen(proc, i);
+		for (size_t j = i; j < i + len; j++) {
+			const struct instr *const ins = &proc->data[j];
+			if (ins->valtype != VT_TEMP || ins->op == IR_ASSIGN || live[ins->val])
+				continue;
+
+			live[ins->val] = true;
+			if (def[ins->val] != NOPOS)
+				array_add((&work), def[ins->val]);
+		}
+	}
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_ASSIGN && !live[proc->data[i].val])
+			inskill(proc, i);
+	}
+
+	free(work.data);
+	free(live);
+	free(def);
+}
+
+// Remove code that can't run or whose results are never needed.
+void
+dce(struct iproc *const proc)
+{
+	if (cutexits(proc))
+		buildcfg(proc);
+
+	if (dropunreachable(proc))
+		buildcfg(proc);
+
+	overwritten(proc);
+	writeonly(proc);
+	unused(proc);
+	buildcfg(proc);
+}
@@ -0,0 +1 @@
+void dce(struct iproc *const proc);
@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <elf.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -33,6 +34,10 @@ elf(const size_t entry, const struct data *const text, const struct data *const
 	ehdr.e_ehsize = sizeof(ehdr);
 
 	size_t pretextlen = sizeof(ehdr) + sizeof(phdr_text) + sizeof(phdr_data);
+	// the data follows the text in the file, at the next page boundary
+	size_t textpad = -text->len & 0xfff;
+
+	assert(TEXT_OFFSET + text->len <= DATA_OFFSET);
 
 	phdr_text.p_type = PT_LOAD;
 	phdr_text.p_offset = 0x1000;
@@ -44,7 +49,7 @@ elf(const size_t entry, const struct data *const text, const struct data *const
 	phdr_text.p_align = 0x1000;
 
 	phdr_data.p_type = PT_LOAD;
-	phdr_data.p_offset = 0x2000;
+	phdr_data.p_offset = 0x1000 + text->len + textpad;
 	phdr_data.p_vaddr = DATA_OFFSET;
 	phdr_data.p_paddr = DATA_OFFSET;
 	phdr_data.p_filesz = data->len;
@@ -57,11 +62,11 @@ elf(const size_t entry, const struct data *const text, const struct data *const
 	fwrite(&phdr_data, sizeof(phdr_data), 1, f);
 	char empty = 0;
 
-	for (int i = 0; i < 0x1000 - pretextlen; i++) {
+	for (size_t i = 0; i < 0x1000 - pretextlen; i++) {
 		fwrite(&empty, 1, 1, f);
 	}
 	fwrite(text->data, 1, text->len, f);
-	for (int i = 0; i < 0x1000 - text->len; i++) {
+	for (size_t i = 0; i < textpad; i++) {
 		fwrite(&empty, 1, 1, f);
 	}
 	fwrite(data->data, 1, data->len, f);
@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "fold.h"
+
+static bool
+isint(const struct expr *const expr)
+{
+	return expr->kind == EXPR_LIT && expr->class == C_INT;
+}
+
+static bool
+isbool(const struct expr *const expr)
+{
+	return expr->kind == EXPR_LIT && expr->class == C_BOOL;
+}
+
+static void
+foldbinary(struct expr *const expr)
+{
+	const struct expr *const left = &exprs.data[expr->d.bop.left];
+	const struct expr *const right = &exprs.data[expr->d.bop.right];
+	struct value v = { 0 };
+	enum class class;
+
+	if (isint(left) && isint(right)) {
+		// literals are 64 bits wide, so do the arithmetic unsigned to get
+		// two's complement wraparound instead of signed overflow
+		const uint64_t l = left->d.v.v.i64, r = right->d.v.v.i64;
+		switch (expr->d.bop.kind) {
+		case BOP_PLUS:
+			v.v.i64 = l + r;
+			class = C_INT;
+			break;
+		case BOP_MINUS:
+			v.v.i64 = l - r;
+			class = C_INT;
+			break;
+		case BOP_GREATER:
+			v.v.i64 = left->d.v.v.i64 > right->d.v.v.i64;
+			class = C_BOOL;
+			break;
+		case BOP_EQUAL:
+			v.v.i64 = l == r;
+			class = C_BOOL;
+			break;
+		default:
+			return;
+		}
+	} else if (isbool(left) && isbool(right) && expr->d.bop.kind == BOP_EQUAL) {
+		v.v.i64 = left->d.v.v.i64 == right->d.v.v.i64;
+		class = C_BOOL;
+	} else {
+		return;
+	}
+
+	expr->kind = EXPR_LIT;
+	expr->class = class;
+	expr->d.v = v;
+}
+
+static void
+foldunary(struct expr *const expr)
+{
+	const struct expr *const operand = &exprs.data[expr->d.uop.expr];
+
+	if (expr->d.uop.kind == UOP_NOT && isbool(operand)) {
+		const int64_t val = !operand->d.v.v.i64;
+		expr->kind = EXPR_LIT;
+		expr->class = C_BOOL;
+		expr->d.v.v.i64 = val;
+	}
+}
+
+// operands are always parsed before the expression using them, so a single
+// pass in index order folds bottom up
+void
+fold()
+{
+	for (size_t i = 0; i < exprs.len; i++) {
+		struct expr *const expr = &exprs.data[i];
+		switch (expr->kind) {
+		case EXPR_BINARY:
+			foldbinary(expr);
+			break;
+		case EXPR_UNARY:
+			foldunary(expr);
+			break;
+		default:
+			break;
+		}
+	}
+}
@@ -0,0 +1,224 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "map.h"
+#include "cfg.h"
+#include "gvn.h"
+
+// what makes two computations the same
+struct vnkey {
+	uint64_t op, a, b, size;
+	uint64_t epoch; // the state of memory, for loads
+};
+
+// a value available in the current block, shadowing 'prev' with the same
+// key while the block and the ones it dominates are visited
+struct avail {
+	uint64_t temp;
+	uint64_t prev;
+	struct vnkey *key;
+};
+
+struct numbering {
+	struct map *map; // key -> index in avail + 1
+	struct vnkey *keys;
+	size_t nkeys;
+	struct {
+		size_t len, cap;
+		struct avail *data;
+	} avail;
+	uint64_t *repl; // redundant temporaries -> the ones they are the same as
+	uint64_t *exitepoch;
+	uint64_t epochs;
+};
+
+static uint64_t
+resolve(const struct numbering *const n, uint64_t t)
+{
+	while (n->repl[t])
+		t = n->repl[t];
+
+	return t;
+}
+
+static uint64_t
+lookup(struct numbering *const n, struct vnkey *const key)
+{
+	struct mapkey mk;
+	mapkey(&mk, key, sizeof(*key));
+	const uint64_t i = mapget(n->map, &mk).n;
+	return i ? n->avail.data[i - 1].temp : 0;
+}
+
+static void
+provide(struct numbering *const n, const struct vnkey *const key, const uint64_t temp)
+{
+	struct vnkey *const stored = &n->keys[n->nkeys++];
+	struct mapkey mk;
+
+	*stored = *key;
+	mapkey(&mk, stored, sizeof(*stored));
+	union mapval *const val = mapput(n->map, &mk);
+	const struct avail avail = { .temp = temp, .prev = val->n, .key = stored };
+	array_add((&n->avail), avail);
+	val->n = n->avail.len;
+}
+
+// Make the values provided since the avail list had length 'len' unavailable
+// again.
+static void
+restore(struct numbering *const n, const size_t len)
+{
+	struct mapkey mk;
+
+	while (n->avail.len > len) {
+		const struct avail *const avail = &n->avail.data[--n->avail.len];
+		mapkey(&mk, avail->key, sizeof(*avail->key));
+		mapput(n->map, &mk)->n = avail->prev;
+	}
+}
+
+// the key of the computation starting at i, or false if it is not one that
+// can be shared
+static bool
+makekey(const struct numbering *const n, const struct iproc *const proc, const size_t i, const uint64_t epoch, struct vnkey *const key)
+{
+	const struct instr *const ins = &proc->data[i];
+	uint64_t a, b;
+
+	memset(key, 0, sizeof(*key));
+	key->op = ins[1].op;
+	key->size = proc->temps.data[ins->val].size;
+
+	switch (ins[1].op) {
+	case IR_IMM:
+		key->a = ins[1].val;
+		return true;
+	case IR_LOAD:
+		key->a = resolve(n, ins[1].val);
+		key->epoch = epoch;
+		return true;
+	case IR_NOT:
+	case IR_ZEXT:
+		key->a = resolve(n, ins[1].val);
+		// zero extension depends on the width of the operand
+		key->b = proc->temps.data[key->a].size;
+		return true;
+	case IR_ADD:
+	case IR_CEQ:
+		a = resolve(n, ins[1].val);
+		b = resolve(n, ins[2].val);
+		// both are commutative
+		key->a = a < b ? a : b;
+		key->b = a < b ? b : a;
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Visit the dominator tree, so that every computation seen before in a
+// dominating block can be reused. Loads are only the same if memory hasn't
+// changed in between: every store or call starts a new epoch, and so does
+// every block that could be entered from somewhere other than its immediate
+// dominator.
+static void
+number(struct numbering *const n, struct iproc *const proc, const uint64_t b)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	const size_t len = n->avail.len;
+	struct vnkey key;
+	uint64_t epoch;
+
+	if (b != 0 && block->preds.len == 1 && block->preds.data[0] == block->idom)
+		epoch = n->exitepoch[block->idom];
+	else
+		epoch = ++n->epochs;
+
+	for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+		struct instr *const ins = &proc->data[i];
+
+		switch (ins->op) {
+		case IR_STORE:
+			epoch = ++n->epochs;
+			// a load right after a store of the same width reads what
+			// was stored
+			memset(&key, 0, sizeof(key));
+			key.op = IR_LOAD;
+			key.a = resolve(n, ins[1].val);
+			key.size = proc->temps.data[ins[1].val].size;
+			key.epoch = epoch;
+			if (proc->temps.data[ins->val].size == key.size)
+				provide(n, &key, resolve(n, ins->val));
+			continue;
+		case IR_CALL:
+			epoch = ++n->epochs;
+			continue;
+		case IR_ASSIGN:
+			break;
+		default:
+			continue;
+		}
+
+		if (ins[1].op == IR_COPY && proc->temps.data[ins[1].val].size == proc->temps.data[ins->val].size) {
+			n->repl[ins->val] = resolve(n, ins[1].val);
+			inskill(proc, i);
+			continue;
+		}
+
+		if (!makekey(n, proc, i, epoch, &key))
+			continue;
+
+		const uint64_t same = lookup(n, &key);
+		if (same) {
+			n->repl[ins->val] = same;
+			inskill(proc, i);
+		} else {
+			provide(n, &key, ins->val);
+		}
+	}
+
+	n->exitepoch[b] = epoch;
+
+	for (size_t j = 0; j < block->kids.len; j++)
+		number(n, proc, block->kids.data[j]);
+
+	restore(n, len);
+}
+
+// Global value numbering over the dominator tree: a computation that is
+// the same as one that dominates it is replaced by the result of that one.
+void
+gvn(struct iproc *const proc)
+{
+	struct numbering n = {
+		.map = mkmap(64),
+		.keys = xmalloc((proc->len + 1) * sizeof(*n.keys)),
+		.repl = xcalloc(proc->temps.len, sizeof(*n.repl)),
+		.exitepoch = xcalloc(proc->blocks.len, sizeof(*n.exitepoch)),
+	};
+
+	number(&n, proc, 0);
+
+	for (size_t i = 0; i < proc->len; i++) {
+		struct instr *const ins = &proc->data[i];
+		if (ins->valtype == VT_TEMP && ins->op != IR_ASSIGN)
+			ins->val = resolve(&n, ins->val);
+	}
+
+	delmap(n.map, NULL);
+	free(n.avail.data);
+	free(n.keys);
+	free(n.repl);
+	free(n.exitepoch);
+
+	buildcfg(proc);
+}
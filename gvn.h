@@ -0,0 +1 @@
+void gvn(struct iproc *const proc);
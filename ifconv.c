@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "simplify.h"
+#include "ifconv.h"
+
+// the most computations an arm can have for both of them to be worth
+// doing on every run instead of branching to one of them
+#define ARMMAX 3
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+// a branch on 'cond' at the end of block 'head' to one of two arms, which
+// meet again in 'join'; an arm can also be the edge straight to 'join'
+struct diamond {
+	uint64_t head, join;
+	uint64_t arm[2]; // for when cond holds and when it doesn't, or NOBLOCK
+	uint64_t from[2]; // the label of the edge into 'join' along each way
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+static bool
+pure(const int op)
+{
+	switch (op) {
+	case IR_IMM:
+	case IR_ADD:
+	case IR_CEQ:
+	case IR_NOT:
+	case IR_ZEXT:
+	case IR_COPY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Whether block s, entered from b only, does little enough that it can
+// always be run without anyone noticing, and then goes to a single block.
+static bool
+isarm(const struct iproc *const proc, const uint64_t b, const uint64_t s)
+{
+	const struct bblock *const block = &proc->blocks.data[s];
+	const uint64_t last = blocklast(proc, s);
+	size_t count = 0;
+
+	if (s == 0 || s == b || block->preds.len != 1 || block->succs.len != 1 || block->succs.data[0] == s)
+		return false;
+
+	for (size_t i = block->start + 1; i < block->end; i += inslen(proc, i)) {
+		const struct instr *const ins = &proc->data[i];
+		if (ins->op == IR_NONE || (i == last && ins->op == IR_JUMP))
+			continue;
+		if (ins->op != IR_ASSIGN || !pure(ins[1].op) || ++count > ARMMAX)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+finddiamond(const struct iproc *const proc, const uint64_t b, struct diamond *const d)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	uint64_t to[2];
+
+	if (block->rpo == NOBLOCK || block->succs.len != 2 || proc->data[blocklast(proc, b)].op != IR_CONDJUMP)
+		return false;
+
+	d->head = b;
+	for (size_t j = 0; j < 2; j++) {
+		const uint64_t s = block->succs.data[j];
+		if (isarm(proc, b, s)) {
+			d->arm[j] = s;
+			d->from[j] = proc->blocks.data[s].label;
+			to[j] = proc->blocks.data[s].succs.data[0];
+		} else {
+			d->arm[j] = NOBLOCK;
+			d->from[j] = block->label;
+			to[j] = s;
+		}
+	}
+
+	d->join = to[0];
+	return to[0] == to[1] && d->join != b && (d->arm[0] != NOBLOCK || d->arm[1] != NOBLOCK) && proc->blocks.data[d->join].preds.len == 2;
+}
+
+// The value the phi at i gets from the block labelled 'label'.
+static uint64_t
+phivalue(const struct iproc *const proc, const size_t i, const uint64_t label)
+{
+	const struct instr *const ins = &proc->data[i];
+	for (size_t j = 0; j < ins[1].val; j++) {
+		if (ins[2 + 2*j].val == label)
+			return ins[3 + 2*j].val;
+	}
+
+	assert(false);
+	return 0;
+}
+
+// Run both arms of every diamond at the end of its head, and pick the value
+// each phi of the join gets with a select on the branch condition instead.
+static bool
+convert(struct iproc *const proc)
+{
+	// the diamond each block is the head of, and whether it is an arm or
+	// the join of one
+	struct diamond *const diamonds = xmalloc(proc->blocks.len * sizeof(*diamonds));
+	bool *const head = xcalloc(proc->blocks.len, sizeof(*head));
+	bool *const gone = xcalloc(proc->blocks.len, sizeof(*gone));
+	bool *const join = xcalloc(proc->blocks.len, sizeof(*join));
+	bool any = false;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		struct diamond *const d = &diamonds[b];
+		if (gone[b] || join[b] || !finddiamond(proc, b, d) || head[d->join] || gone[d->join])
+			continue;
+
+		head[b] = join[d->join] = any = true;
+		for (size_t j = 0; j < 2; j++) {
+			if (d->arm[j] != NOBLOCK)
+				gone[d->arm[j]] = true;
+		}
+	}
+
+	if (any) {
+		struct code code = { 0 };
+		for (size_t b = 0; b < proc->blocks.len; b++) {
+			const struct bblock *const block = &proc->blocks.data[b];
+			if (gone[b])
+				continue;
+
+			if (!head[b]) {
+				// the phis of a join are selects in its head now
+				for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+					if (!join[b] || proc->data[i].op != IR_ASSIGN || proc->data[i + 1].op != IR_PHI)
+						array_push((&code), &proc->data[i], inslen(proc, i));
+				}
+				continue;
+			}
+
+			const struct diamond *const d = &diamonds[b];
+			const uint64_t last = blocklast(proc, b);
+			const uint64_t cond = proc->data[last + 1].val;
+			array_push((&code), &proc->data[block->start], last - block->start);
+
+			for (size_t j = 0; j < 2; j++) {
+				if (d->arm[j] == NOBLOCK)
+					continue;
+
+				const struct bblock *const arm = &proc->blocks.data[d->arm[j]];
+				const uint64_t end = blocklast(proc, d->arm[j]);
+				const size_t to = proc->data[end].op == IR_JUMP ? end : arm->end;
+				array_push((&code), &proc->data[arm->start + 1], to - arm->start - 1);
+			}
+
+			const struct bblock *const target = &proc->blocks.data[d->join];
+			for (size_t i = target->start; i < target->end; i += inslen(proc, i)) {
+				if (proc->data[i].op != IR_ASSIGN || proc->data[i + 1].op != IR_PHI)
+					continue;
+
+				put(&code, IR_ASSIGN, proc->data[i].val, VT_TEMP);
+				put(&code, IR_SELECT, cond, VT_TEMP);
+				put(&code, IR_EXTRA, phivalue(proc, i, d->from[0]), VT_TEMP);
+				put(&code, IR_EXTRA, phivalue(proc, i, d->from[1]), VT_TEMP);
+			}
+			put(&code, IR_JUMP, target->label, VT_LABEL);
+		}
+
+		free(proc->data);
+		proc->data = code.data;
+		proc->len = code.len;
+		proc->cap = code.cap;
+		buildcfg(proc);
+	}
+
+	free(join);
+	free(gone);
+	free(head);
+	free(diamonds);
+	return any;
+}
+
+// If-conversion: branches around a few computations that only decide what
+// values some variables have afterwards are replaced by computing all of
+// them and selecting between the results, which a target can do without
+// jumping anywhere. Diamonds inside diamonds are flattened from the inside
+// out.
+void
+ifconvert(struct iproc *const proc)
+{
+	while (convert(proc))
+		simplifycfg(proc);
+}
@@ -0,0 +1 @@
+void ifconvert(struct iproc *const proc);
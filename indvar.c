@@ -0,0 +1,348 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "indvar.h"
+
+#define NOPOS UINT64_MAX
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+// a variable of a loop that starts out as 'init' and has 'step' added to
+// it on every iteration
+struct indvar {
+	uint64_t temp;
+	uint64_t pos; // of its phi
+	uint64_t init, step;
+};
+
+struct ivs {
+	size_t len, cap;
+	struct indvar *data;
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+// offset of the definition of each temporary
+static uint64_t *
+definitions(const struct iproc *const proc)
+{
+	uint64_t *const def = xmalloc(proc->temps.len * sizeof(*def));
+
+	for (size_t t = 0; t < proc->temps.len; t++)
+		def[t] = NOPOS;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_ASSIGN)
+			def[proc->data[i].val] = i;
+	}
+
+	return def;
+}
+
+static uint64_t
+mask(const uint64_t val, const uint8_t size)
+{
+	return size >= 8 ? val : val & ((UINT64_C(1) << 8*size) - 1);
+}
+
+static bool
+isimm(const struct iproc *const proc, const uint64_t *const def, const uint64_t t, uint64_t *const val)
+{
+	if (def[t] == NOPOS || proc->data[def[t] + 1].op != IR_IMM)
+		return false;
+
+	*val = proc->data[def[t] + 1].val;
+	return true;
+}
+
+// The basic induction variables of the loop with header h: phis taking a
+// constant from the one way into the loop, and themselves plus a constant
+// from the one way back.
+static void
+findivs(const struct iproc *const proc, const uint64_t *const def, const uint64_t h, struct ivs *const ivs)
+{
+	const struct bblock *const header = &proc->blocks.data[h];
+	uint64_t latch = NOBLOCK, pre = NOBLOCK;
+
+	ivs->len = 0;
+	for (size_t j = 0; j < header->preds.len; j++) {
+		const uint64_t pred = header->preds.data[j];
+		if (proc->blocks.data[pred].rpo == NOBLOCK)
+			continue;
+
+		uint64_t *const which = dominates(proc, h, pred) ? &latch : &pre;
+		if (*which != NOBLOCK)
+			return;
+		*which = pred;
+	}
+
+	if (latch == NOBLOCK || pre == NOBLOCK)
+		return;
+
+	for (size_t i = header->start + 1; i < header->end; i += inslen(proc, i)) {
+		const struct instr *const ins = &proc->data[i];
+		if (ins->op != IR_ASSIGN || ins[1].op != IR_PHI)
+			break;
+
+		if (ins[1].val != 2)
+			continue;
+
+		struct indvar iv = { .temp = ins->val, .pos = i };
+		uint64_t next = 0;
+		bool ok = true;
+		for (size_t j = 0; j < 2; j++) {
+			const uint64_t from = labelblock(proc, ins[2 + 2*j].val), t = ins[3 + 2*j].val;
+			if (from == pre)
+				ok &= isimm(proc, def, t, &iv.init);
+			else if (from == latch)
+				next = t;
+			else
+				ok = false;
+		}
+
+		if (!ok || !next || def[next] == NOPOS)
+			continue;
+
+		const struct instr *const add = &proc->data[def[next]];
+		if (add[1].op != IR_ADD || proc->temps.data[next].size != proc->temps.data[iv.temp].size)
+			continue;
+
+		if (add[1].val == iv.temp)
+			ok = isimm(proc, def, add[2].val, &iv.step);
+		else if (add[2].val == iv.temp)
+			ok = isimm(proc, def, add[1].val, &iv.step);
+		else
+			ok = false;
+
+		if (ok)
+			array_add(ivs, iv);
+	}
+}
+
+// Two variables stepping by the same amount stay the same distance apart,
+// so only one of them has to be carried around the loop: the others are
+// computed from it. Returns whether anything changed.
+static bool
+merge(struct iproc *const proc)
+{
+	uint64_t *const def = definitions(proc);
+	struct code *const extra = xcalloc(proc->blocks.len, sizeof(*extra));
+	struct code entry = { 0 };
+	struct ivs ivs = { 0 };
+	bool changed = false;
+
+	for (size_t h = 0; h < proc->blocks.len; h++) {
+		findivs(proc, def, h, &ivs);
+		for (size_t k = 0; k < ivs.len; k++) {
+			const struct indvar *const y = &ivs.data[k];
+			for (size_t j = 0; j < k; j++) {
+				const struct indvar *const x = &ivs.data[j];
+				const uint8_t size = proc->temps.data[y->temp].size;
+				if (x->step != y->step || proc->temps.data[x->temp].size != size)
+					continue;
+
+				const uint64_t d = newtemp(proc, size, TF_INT);
+				put(&entry, IR_ASSIGN, d, VT_TEMP);
+				put(&entry, IR_IMM, y->init - x->init, VT_IMM);
+				put(&extra[h], IR_ASSIGN, y->temp, VT_TEMP);
+				put(&extra[h], IR_ADD, x->temp, VT_TEMP);
+				put(&extra[h], IR_EXTRA, d, VT_TEMP);
+				inskill(proc, y->pos);
+				changed = true;
+				break;
+			}
+		}
+	}
+
+	if (changed) {
+		struct code code = { 0 };
+		for (size_t b = 0; b < proc->blocks.len; b++) {
+			const struct bblock *const block = &proc->blocks.data[b];
+			size_t i = block->start + 1;
+
+			array_push((&code), &proc->data[block->start], 1);
+			if (b == 0 && entry.len)
+				array_push((&code), entry.data, entry.len);
+
+			// after the phis, which have to stay together at the start
+			while (i < block->end && (proc->data[i].op == IR_NONE || (proc->data[i].op == IR_ASSIGN && proc->data[i + 1].op == IR_PHI))) {
+				array_push((&code), &proc->data[i], inslen(proc, i));
+				i += inslen(proc, i);
+			}
+
+			if (extra[b].len)
+				array_push((&code), extra[b].data, extra[b].len);
+			array_push((&code), &proc->data[i], block->end - i);
+		}
+
+		free(proc->data);
+		proc->data = code.data;
+		proc->len = code.len;
+		proc->cap = code.cap;
+	}
+
+	for (size_t b = 0; b < proc->blocks.len; b++)
+		free(extra[b].data);
+	free(extra);
+	free(entry.data);
+	free(ivs.data);
+	free(def);
+
+	return changed;
+}
+
+// x + a == b is the same as x == b - a, which means the loop can test the
+// variable it carries instead of one computed from it.
+static void
+retest(struct iproc *const proc)
+{
+	uint64_t *const def = definitions(proc);
+	struct code code = { 0 };
+	bool changed = false;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		struct instr *const ins = &proc->data[i];
+		uint64_t a, b;
+
+		if (ins->op != IR_ASSIGN || ins[1].op != IR_CEQ)
+			continue;
+
+		for (size_t j = 1; j <= 2; j++) {
+			const uint64_t sum = ins[j].val, other = ins[3 - j].val;
+			if (!isimm(proc, def, other, &b) || def[sum] == NOPOS || proc->data[def[sum] + 1].op != IR_ADD)
+				continue;
+
+			const struct instr *const add = &proc->data[def[sum]];
+			uint64_t x;
+			if (isimm(proc, def, add[2].val, &a))
+				x = add[1].val;
+			else if (isimm(proc, def, add[1].val, &a))
+				x = add[2].val;
+			else
+				continue;
+
+			if (proc->temps.data[x].size != proc->temps.data[sum].size)
+				continue;
+
+			const uint64_t k = newtemp(proc, proc->temps.data[other].size, TF_INT);
+			put(&code, IR_ASSIGN, k, VT_TEMP);
+			put(&code, IR_IMM, b - a, VT_IMM);
+			ins[1].val = x;
+			ins[2].val = k;
+			changed = true;
+			break;
+		}
+	}
+
+	if (changed) {
+		// the immediates go right after the entry label
+		struct code imms = code;
+		code = (struct code){ 0 };
+		array_push((&code), proc->data, 1);
+		array_push((&code), imms.data, imms.len);
+		array_push((&code), &proc->data[1], proc->len - 1);
+		free(imms.data);
+
+		free(proc->data);
+		proc->data = code.data;
+		proc->len = code.len;
+		proc->cap = code.cap;
+	}
+
+	free(def);
+}
+
+// Find the variables of each loop that go up by a constant on every
+// iteration, keep only one of those that go up by the same amount, and
+// make the exit tests use it directly.
+void
+indvars(struct iproc *const proc)
+{
+	if (merge(proc))
+		buildcfg(proc);
+
+	retest(proc);
+	buildcfg(proc);
+}
+
+// Whether the loop with header h leaves for block 'exit' after a number of
+// iterations that is known before it runs and at most 'limit', found by
+// running its test on each value of the induction variable it compares with
+// a constant. If so, that number goes in 'trips'.
+bool
+tripcount(const struct iproc *const proc, const uint64_t h, const uint64_t exit, const uint64_t limit, uint64_t *const trips)
+{
+	const struct bblock *const header = &proc->blocks.data[h];
+	const struct instr *const last = &proc->data[blocklast(proc, h)];
+	uint64_t *const def = definitions(proc);
+	struct ivs ivs = { 0 };
+	bool found = false, negate = false;
+	uint64_t cond;
+
+	if (last->op != IR_CONDJUMP || header->succs.len != 2) {
+		free(def);
+		return false;
+	}
+
+	cond = last[1].val;
+	if (def[cond] != NOPOS && proc->data[def[cond] + 1].op == IR_NOT) {
+		negate = true;
+		cond = proc->data[def[cond] + 1].val;
+	}
+
+	findivs(proc, def, h, &ivs);
+	if (def[cond] != NOPOS && proc->data[def[cond] + 1].op == IR_CEQ) {
+		const struct instr *const ceq = &proc->data[def[cond]];
+		const uint8_t size = proc->temps.data[cond].size;
+
+		for (size_t j = 0; j < ivs.len && !found; j++) {
+			const struct indvar *const iv = &ivs.data[j];
+			const uint8_t ivsize = proc->temps.data[iv->temp].size;
+
+			uint64_t other, k;
+
+			if (ceq[1].val == iv->temp)
+				other = ceq[2].val;
+			else if (ceq[2].val == iv->temp)
+				other = ceq[1].val;
+			else
+				continue;
+
+			if (!isimm(proc, def, other, &k))
+				continue;
+
+			// the fallthrough edge is taken when the condition holds
+			uint64_t x = iv->init;
+			for (uint64_t n = 0; n <= limit; n++) {
+				const bool holds = (mask(x, size) == mask(k, size)) != negate;
+				if (header->succs.data[holds ? 0 : 1] == exit) {
+					*trips = n;
+					found = true;
+					break;
+				}
+				x = mask(x + iv->step, ivsize);
+			}
+		}
+	}
+
+	free(ivs.data);
+	free(def);
+	return found;
+}
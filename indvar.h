@@ -0,0 +1,2 @@
+void indvars(struct iproc *const proc);
+bool tripcount(const struct iproc *const proc, const uint64_t h, const uint64_t exit, const uint64_t limit, uint64_t *const trips);
@@ -0,0 +1,208 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "inline.h"
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+// the number of instructions in proc, which is what inlining it costs
+static size_t
+cost(const struct iproc *const proc)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op != IR_LABEL)
+			n++;
+	}
+
+	return n;
+}
+
+// Whether the call at i should be replaced by the body of the callee: only
+// procedures with a body of their own can be, and only if they are small or
+// this is the only place they are called from, since then the body doesn't
+// have to be kept around.
+static bool
+worthit(const struct iproc *const proc, const size_t i, const size_t *const ncalls, const size_t threshold)
+{
+	const uint64_t c = proc->data[i].val;
+	const struct iproc *const callee = &toplevel.code.data[c];
+
+	if (callee == proc || !callee->len || !threshold)
+		return false;
+
+	// the entry of the callee becomes an ordinary block in the caller,
+	// which would need phis if anything jumped back to it
+	if (callee->blocks.data[0].preds.len)
+		return false;
+
+	return ncalls[c] == 1 || cost(callee) <= threshold;
+}
+
+// Copy the body of the procedure called at i into code, with temporaries
+// and labels of its own, so that it reads its parameters from the arguments
+// of the call and goes to 'cont' instead of returning. Allocations go to
+// 'allocs', to be done once at the start of the caller rather than every
+// time the body runs.
+static void
+expand(struct iproc *const proc, const size_t i, struct code *const code, struct code *const allocs, const uint64_t cont)
+{
+	const struct iproc *const callee = &toplevel.code.data[proc->data[i].val];
+	const size_t count = inslen(proc, i) - 1;
+	uint64_t *const temps = xcalloc(callee->temps.len, sizeof(*temps));
+	uint64_t *const labels = xmalloc(callee->labels.len * sizeof(*labels));
+
+	labels[0] = 0;
+	for (size_t l = 1; l < callee->labels.len; l++)
+		labels[l] = newlabel(proc);
+
+	// arguments are listed last to first, so parameter k is passed in
+	// the callarg count - k; those of the same width can be used as is
+	for (size_t j = 0; j < callee->len; j += inslen(callee, j)) {
+		const struct instr *const ins = &callee->data[j];
+		if (ins->op != IR_ASSIGN || ins[1].op != IR_IN)
+			continue;
+
+		assert(ins[1].val < count);
+		const uint64_t arg = proc->data[i + count - ins[1].val].val;
+		if (proc->temps.data[arg].size == callee->temps.data[ins->val].size)
+			temps[ins->val] = arg;
+	}
+
+	for (size_t t = 1; t < callee->temps.len; t++) {
+		if (!temps[t])
+			temps[t] = newtemp(proc, callee->temps.data[t].size, callee->temps.data[t].flags);
+	}
+
+	for (size_t j = 0; j < callee->len; j += inslen(callee, j)) {
+		const struct instr *const ins = &callee->data[j];
+		const size_t len = inslen(callee, j);
+
+		if (ins->op == IR_RETURN) {
+			put(code, IR_JUMP, cont, VT_LABEL);
+			continue;
+		}
+
+		if (ins->op == IR_ASSIGN && ins[1].op == IR_IN) {
+			const uint64_t arg = proc->data[i + count - ins[1].val].val;
+			if (temps[ins->val] != arg) {
+				put(code, IR_ASSIGN, temps[ins->val], VT_TEMP);
+				put(code, IR_COPY, arg, VT_TEMP);
+			}
+			continue;
+		}
+
+		struct code *const to = ins->op == IR_ASSIGN && ins[1].op == IR_ALLOC ? allocs : code;
+		for (size_t k = j; k < j + len; k++) {
+			struct instr copy = callee->data[k];
+			if (copy.valtype == VT_TEMP)
+				copy.val = temps[copy.val];
+			else if (copy.valtype == VT_LABEL)
+				copy.val = labels[copy.val];
+			array_add(to, copy);
+		}
+	}
+
+	free(labels);
+	free(temps);
+}
+
+// Replace the calls in proc that are worth it with the bodies of the
+// procedures they call. 'ncalls' has how many calls there are to each
+// procedure in the program, and is kept up to date. Returns whether
+// anything was inlined, in which case the caller is worth optimizing again.
+bool
+inlinecalls(struct iproc *const proc, size_t *const ncalls, const size_t threshold)
+{
+	struct code code = { 0 }, allocs = { 0 };
+	// for the phis of successors of blocks that had a call split off
+	uint64_t *const relabel = xmalloc(proc->labels.len * sizeof(*relabel));
+	const size_t nlabels = proc->labels.len;
+	uint64_t orig = 0;
+	bool changed = false;
+
+	for (size_t l = 0; l < nlabels; l++)
+		relabel[l] = l;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		const struct instr *const ins = &proc->data[i];
+		if (ins->op == IR_LABEL)
+			orig = ins->val;
+
+		if (ins->op != IR_CALL || !worthit(proc, i, ncalls, threshold)) {
+			array_push((&code), ins, inslen(proc, i));
+			continue;
+		}
+
+		const uint64_t c = ins->val, cont = newlabel(proc);
+		const struct iproc *const callee = &toplevel.code.data[c];
+
+		// the calls made by the callee are now made from here as well
+		ncalls[c]--;
+		for (size_t j = 0; j < callee->len; j += inslen(callee, j)) {
+			if (callee->data[j].op == IR_CALL)
+				ncalls[callee->data[j].val]++;
+		}
+
+		expand(proc, i, &code, &allocs, cont);
+		put(&code, IR_LABEL, cont, VT_LABEL);
+		relabel[orig] = cont;
+		changed = true;
+	}
+
+	if (!changed) {
+		free(code.data);
+		free(relabel);
+		return false;
+	}
+
+	for (size_t i = 0; i < code.len; i++) {
+		struct instr *const ins = &code.data[i];
+		if (ins->op != IR_ASSIGN || ins[1].op != IR_PHI)
+			continue;
+
+		for (size_t j = 0; j < ins[1].val; j++) {
+			struct instr *const label = &ins[2 + 2*j];
+			if (label->val < nlabels)
+				label->val = relabel[label->val];
+		}
+		i += 1 + 2*ins[1].val;
+	}
+
+	free(proc->data);
+	proc->data = NULL;
+	proc->len = proc->cap = 0;
+
+	assert(code.data[0].op == IR_LABEL);
+	array_push(proc, code.data, 1);
+	if (allocs.len)
+		array_push(proc, allocs.data, allocs.len);
+	array_push(proc, &code.data[1], code.len - 1);
+
+	free(allocs.data);
+	free(code.data);
+	free(relabel);
+
+	buildcfg(proc);
+	return true;
+}
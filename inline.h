@@ -0,0 +1 @@
+bool inlinecalls(struct iproc *const proc, size_t *const ncalls, const size_t threshold);
@@ -10,30 +10,53 @@
 #include "stack.h"
 #include "ir.h"
 #include "util.h"
-#include "target.h"
-
-#define STARTINS(op, val, valtype) putins((out), (op), (val), (valtype)) ; curi++ ;
-#define LABEL(l) out->labels.data[l] = reali; STARTINS(IR_LABEL, l, VT_LABEL);
-#define NEWTMP tmpi++; { struct temp temp = { .start = curi + 1, .end = curi + 1, .block = rblocki - 1 }; array_add((&out->temps), temp); }
-#define NEWBLOCK(start, end) { struct iblock block = { (start), (end), .used = { 0 } }; array_add((&out->blocks), block); } rblocki++;
+#include "map.h"
+#include "cfg.h"
+#include "ssa.h"
+#include "mem2reg.h"
+#include "sccp.h"
+#include "gvn.h"
+#include "dce.h"
+#include "licm.h"
+#include "indvar.h"
+#include "loop.h"
+#include "simplify.h"
+#include "ifconv.h"
 
 #define PTRSIZE 8
 
-static uint64_t tmpi, labeli, curi, reali, rblocki, out_index;
+static uint64_t out_index;
 static struct stack *blocks, loops;
 
 static void
 genblock(struct iproc *const out, const struct block *const block);
 
+void
+addiproc(struct toplevel *const toplevel, const struct iproc *const iproc)
+{
+	struct mapkey key;
+	array_add((&toplevel->code), (*iproc));
+	mapkey(&key, iproc->s.data, iproc->s.len);
+	mapput(toplevel->procs, &key)->n = toplevel->code.len;
+}
+
+struct iproc *
+findiproc(const struct toplevel *const toplevel, const struct slice *const s)
+{
+	struct mapkey key;
+	mapkey(&key, s->data, s->len);
+	const uint64_t i = mapget(toplevel->procs, &key).n;
+	return i ? &toplevel->code.data[i - 1] : NULL;
+}
+
 static uint64_t
 procindex(const struct slice *const s)
 {
-	for (size_t i = 0; i < toplevel.code.len; i++)
-		if (slice_cmp(s, &toplevel.code.data[i].s) == 0)
-			return i;
+	const struct iproc *const iproc = findiproc(&toplevel, s);
+	if (!iproc)
+		die("unknown function, should be unreachable");
 
-	die("unknown function, should be unreachable");
-	return 0;
+	return iproc - toplevel.code.data;
 }
 
 static void
@@ -54,6 +77,7 @@ putins(struct iproc *const out, const int op, const uint64_t val, const int valt
 		case IR_LOAD:
 		case IR_ADD:
 		case IR_CEQ:
+		case IR_SELECT:
 		case IR_NOT:
 		case IR_ZEXT:
 		case IR_ASSIGN:
@@ -63,8 +87,6 @@ putins(struct iproc *const out, const int op, const uint64_t val, const int valt
 		default:
 			die("putins: bad op for VT_TEMP");
 		}
-		out->temps.data[val].end = curi;
-		array_add((&out->blocks.data[rblocki - 1].used), val);
 		break;
 	case VT_LABEL:
 		switch (op) {
@@ -107,23 +129,19 @@ putins(struct iproc *const out, const int op, const uint64_t val, const int valt
 	}
 
 	array_add(out, ins);
-	reali++;
 }
 
-static uint64_t
-bumplabel(struct iproc *const out)
+static void
+label(struct iproc *const out, const uint64_t l)
 {
-	uint64_t temp;
-	array_addlit((&out->labels), 0);
-	return labeli++;
+	putins(out, IR_LABEL, l, VT_LABEL);
 }
 
 static size_t
 assign(struct iproc *const out, const uint8_t size)
 {
-	size_t t = NEWTMP;
-	STARTINS(IR_ASSIGN, t, VT_TEMP);
-	out->temps.data[t].size = size;
+	size_t t = newtemp(out, size, TF_INT);
+	putins(out, IR_ASSIGN, t, VT_TEMP);
 	return t;
 }
 
@@ -155,7 +173,7 @@ alloc(struct iproc *const out, const uint8_t size, const uint64_t count)
 static void
 store(struct iproc *const out, const uint8_t size, const uint64_t src, const uint64_t dest)
 {
-	STARTINS(IR_STORE, src, VT_TEMP);
+	putins(out, IR_STORE, src, VT_TEMP);
 	putins(out, IR_EXTRA, dest, VT_TEMP);
 }
 
@@ -171,6 +189,9 @@ genexpr(struct iproc *const out, const size_t expri, uint64_t *const val)
 			// FIXME: size should not be hardcoded
 			*val = immediate(out, 8, expr->d.v.v.i64);
 			break;
+		case C_BOOL:
+			*val = immediate(out, 1, expr->d.v.v.i64);
+			break;
 		default:
 			die("genexpr: EXPR_LIT: unhandled class");
 		}
@@ -275,7 +296,7 @@ genexpr(struct iproc *const out, const size_t expri, uint64_t *const val)
 		}
 		params[expr->d.call.params.len].val = out_index;
 		params[expr->d.call.params.len].valtype = VT_TEMP;
-		STARTINS(IR_CALL, proc, VT_FUNC);
+		putins(out, IR_CALL, proc, VT_FUNC);
 		for (size_t i = expr->d.call.params.len; i <= expr->d.call.params.len; i--) {
 			putins(out, IR_CALLARG, params[i].val, params[i].valtype);
 		}
@@ -286,42 +307,36 @@ genexpr(struct iproc *const out, const size_t expri, uint64_t *const val)
 	case EXPR_COND: {
 		uint64_t condtmp;
 		int valtype = genexpr(out, expr->d.cond.cond, &condtmp);
-		size_t startlabel = bumplabel(out), endlabel = bumplabel(out);
+		const uint64_t endlabel = newlabel(out);
 		if (expr->d.cond.belse.len) {
-			size_t elselabel = bumplabel(out);
-			stackpush(blocks, &expr->d.cond.bif);
-			NEWBLOCK(startlabel, elselabel);
-			LABEL(startlabel);
-			STARTINS(IR_CONDJUMP, elselabel, VT_LABEL);
+			const uint64_t elselabel = newlabel(out);
+			putins(out, IR_CONDJUMP, elselabel, VT_LABEL);
 			putins(out, IR_EXTRA, condtmp, valtype);
+			stackpush(blocks, &expr->d.cond.bif);
 			genblock(out, &expr->d.cond.bif);
 			stackpop(blocks);
-			STARTINS(IR_JUMP, endlabel, VT_LABEL);
+			putins(out, IR_JUMP, endlabel, VT_LABEL);
+			label(out, elselabel);
 			stackpush(blocks, &expr->d.cond.belse);
-			NEWBLOCK(elselabel, endlabel);
-			LABEL(elselabel);
 			genblock(out, &expr->d.cond.belse);
 			stackpop(blocks);
-			LABEL(endlabel);
 		} else {
-			stackpush(blocks, &expr->d.cond.bif);
-			STARTINS(IR_CONDJUMP, endlabel, VT_LABEL);
-			NEWBLOCK(startlabel, endlabel);
+			putins(out, IR_CONDJUMP, endlabel, VT_LABEL);
 			putins(out, IR_EXTRA, condtmp, valtype);
+			stackpush(blocks, &expr->d.cond.bif);
 			genblock(out, &expr->d.cond.bif);
 			stackpop(blocks);
-			LABEL(endlabel);
 		}
+		label(out, endlabel);
 		return VT_EMPTY;
 	}
 	case EXPR_LOOP: {
-		size_t startlabel = bumplabel(out), endlabel = bumplabel(out);
-		NEWBLOCK(startlabel, endlabel);
-		stackpush(&loops, &out->blocks.data[out->blocks.len - 1]);
-		LABEL(startlabel);
+		const uint64_t startlabel = newlabel(out), endlabel = newlabel(out);
+		stackpush(&loops, &endlabel);
+		label(out, startlabel);
 		genblock(out, &expr->d.loop.block);
-		STARTINS(IR_JUMP, startlabel, VT_LABEL);
-		LABEL(endlabel);
+		putins(out, IR_JUMP, startlabel, VT_LABEL);
+		label(out, endlabel);
 		stackpop(&loops);
 		return VT_EMPTY;
 	}
@@ -353,19 +368,34 @@ static void
 genassign(struct iproc *const out, const struct decl *const decl, const size_t val)
 {
 	struct type *type = &types.data[decl->type];
-	uint64_t what;
-	if (exprs.data[val].kind == EXPR_FCALL) {
-		out_index = decl->index;
+	uint64_t what, dest = decl->index;
+	if (decl->toplevel) {
+		// stores take their width from the address, like with locals
+		dest = immediate(out, type->size, decl->w.addr);
+	}
+
+	if (exprs.data[val].kind == EXPR_FCALL && !decl->toplevel) {
+		out_index = dest;
 		genexpr(out, val, &what);
 	} else {
-		int valtype = genexpr(out, val, &what);
-		assert(valtype == VT_TEMP);
+		if (exprs.data[val].kind == EXPR_FCALL) {
+			// the callee stores its result with its own width, so go
+			// through a local rather than letting it write past the
+			// global
+			const uint64_t ret = out_index = alloc(out, 8, 1);
+			genexpr(out, val, &what);
+			what = load(out, type->size, ret);
+		} else {
+			int valtype = genexpr(out, val, &what);
+			assert(valtype == VT_TEMP);
+		}
+
 		switch (type->size) {
 		case 1:
 		case 2:
 		case 4:
 		case 8:
-			store(out, type->size, what, decl->index);
+			store(out, type->size, what, dest);
 			break;
 		default:
 			die("ir_genproc: unknown size");
@@ -408,10 +438,10 @@ genblock(struct iproc *const out, const struct block *const block)
 			genexpr(out, statement->idx, &what);
 			break;
 		case STMT_RETURN:
-			STARTINS(IR_RETURN, 0, VT_EMPTY);
+			putins(out, IR_RETURN, 0, VT_EMPTY);
 			break;
 		case STMT_BREAK:
-			STARTINS(IR_JUMP, ((struct iblock *)loops.data[loops.idx - 1])->end, VT_LABEL);
+			putins(out, IR_JUMP, *(const uint64_t *)stackpeek(&loops), VT_LABEL);
 			break;
 		default:
 			die("ir_genproc: unreachable");
@@ -420,104 +450,115 @@ genblock(struct iproc *const out, const struct block *const block)
 }
 
 static void
-chooseregs(const struct iproc *const proc)
+genstart(struct stack *blockstack, struct iproc *const out)
 {
-	bool active[proc->temps.len];
-	uint16_t regs = targ.reserved;
-	memset(active, 0, proc->temps.len * sizeof(*active));
-
-	// FIXME: can this happen in the generation loop?
-	for (size_t i = 0; i < proc->blocks.len; i++) {
-		for (size_t j = 0; j < proc->blocks.data[i].used.len; j++) {
-			uint64_t *curend = &proc->temps.data[proc->blocks.data[i].used.data[j]].end;
-			uint64_t curblock = proc->temps.data[proc->blocks.data[i].used.data[j]].block;
-			uint64_t blockend = proc->labels.data[proc->blocks.data[i].end];
-			if (curblock != i && *curend < blockend) {
-				*curend = blockend;
-			}
-		}
-	}
+	uint64_t temp;
+	blocks = blockstack;
+	loops = (struct stack){ 0 };
 
-	// FIXME: this is obviously not close to optimal
-	for (uint64_t i = 0; i <= curi; i++) {
-		for (size_t j = 0; j < proc->temps.len; j++) {
-			if (active[j] && proc->temps.data[j].end == i - 1) {
-				active[j] = false;
-				assert(regs & (1 << proc->temps.data[j].reg));
-				regs &= ~(1 << proc->temps.data[j].reg);
-			}
+	// temporary and label 0 are never used
+	newtemp(out, 0, 0);
+	array_addlit((&out->labels), 0);
 
-			if (!active[j] && proc->temps.data[j].start == i) {
-				active[j] = true;
-				
-				int free = ffs(~regs);
-				if (!free)
-					die("out of registers!");
-
-				// the nth register being free corresponds to shifting by n-1
-				free--;
-				regs |= (1 << free);
-				proc->temps.data[j].reg = free;
-			}
-		}
-	}
+	label(out, newlabel(out));
 }
 
+// Run the passes that work on SSA form, in an order where each can clean up
+// after the ones before it.
 void
-genproc(struct stack *blockstack, struct iproc *const out, const struct proc *const proc)
+optimize(struct iproc *const out)
 {
-	tmpi = labeli = curi = 1;
-	rblocki = reali = 0;
-	blocks = blockstack;
-	loops = (struct stack){ 0 };
-	struct type *type;
+	mem2reg(out);
+	sccp(out, NULL, 0);
+	gvn(out);
+	dce(out);
+	licm(out);
+	indvars(out);
+	unroll(out, unrolllimit);
+	rotate(out);
+	// hoisting can bring the same computation from different loops
+	// together
+	gvn(out);
+	dce(out);
+	simplifycfg(out);
+	ifconvert(out);
+}
 
-	// put a blank interval, since tmpi starts at 1
-	{
-		struct temp temp = { 0 };
-		array_add((&out->temps), temp);
-	}
-	array_add((&out->labels), labeli);
+static void
+genend(struct iproc *const out)
+{
+	// falling off the end of a procedure returns from it
+	putins(out, IR_RETURN, 0, VT_EMPTY);
 
-	size_t startlabel = bumplabel(out), endlabel = bumplabel(out);
-	{
-		struct iblock block = { startlabel, endlabel, .used = { 0 } };
-		array_add((&out->blocks), block);
-		rblocki++;
-	}
+	if (loops.data)
+		free(loops.data);
 
+	buildcfg(out);
+	optimize(out);
+	ssacheck(out);
+}
+
+void
+genproc(struct stack *blockstack, struct iproc *const out, const struct proc *const proc)
+{
+	struct type *type;
 	size_t i = 0;
 
-	LABEL(startlabel);
+	genstart(blockstack, out);
+
 	for (size_t j = 0; j < proc->in.len; j++, i++) {
 		struct decl *decl = finddecl(blocks, proc->in.data[j].name);
 		type = &types.data[proc->in.data[j].type];
-		size_t what = NEWTMP;
-		decl->index = what;
-		STARTINS(IR_ASSIGN, what, VT_TEMP);
-		out->temps.data[what].flags = TF_INT; // FIXME: move this to a separate function?
-		out->temps.data[what].size = type->size; // FIXME: should we check that it's a power of 2?
+		// FIXME: should we check that the size is a power of 2?
+		decl->index = newtemp(out, type->size, TF_INT);
+		putins(out, IR_ASSIGN, decl->index, VT_TEMP);
 		putins(out, IR_IN, i, VT_IMM);
 	}
 
 	for (size_t j = 0; j < proc->out.len; j++, i++) {
 		struct decl *decl = finddecl(blocks, proc->out.data[j].name);
 		type = &types.data[proc->out.data[j].type];
-		size_t what = NEWTMP;
-		decl->index = what;
-		STARTINS(IR_ASSIGN, what, VT_TEMP);
-		out->temps.data[what].flags = TF_PTR; // FIXME: move this to a separate function?
-		out->temps.data[what].size = type->size; // FIXME: should we check that it's a power of 2?
+		decl->index = newtemp(out, type->size, TF_PTR);
+		putins(out, IR_ASSIGN, decl->index, VT_TEMP);
 		putins(out, IR_IN, i, VT_IMM);
 	}
 
+	// every call passes a place for the result, even if there is none
+	out->nargs = proc->out.len ? i : i + 1;
+
 	stackpush(blocks, &proc->block);
 	genblock(out, &proc->block);
 	stackpop(blocks);
 
-	if (loops.data)
-		free(loops.data);
+	genend(out);
+}
+
+// Generate a procedure that evaluates the initializer of a global and
+// stores it through its only parameter, the address of the global. It is
+// only ever interpreted, so it is left in SSA form.
+void
+geninit(struct stack *blockstack, struct iproc *const out, const struct decl *const decl)
+{
+	const struct type *const type = &types.data[decl->type];
+	uint64_t what, dest;
+
+	genstart(blockstack, out);
+
+	dest = newtemp(out, type->size, TF_PTR);
+	putins(out, IR_ASSIGN, dest, VT_TEMP);
+	putins(out, IR_IN, 0, VT_IMM);
+
+	if (exprs.data[decl->val].kind == EXPR_FCALL) {
+		// the callee stores its result with its own width, so go through
+		// a local rather than letting it write past the global
+		const uint64_t ret = out_index = alloc(out, 8, 1);
+		genexpr(out, decl->val, &what);
+		what = load(out, type->size, ret);
+	} else {
+		int valtype = genexpr(out, decl->val, &what);
+		assert(valtype == VT_TEMP);
+	}
 
-	LABEL(endlabel);
-	chooseregs(out);
+	store(out, type->size, what, dest);
+	genend(out);
 }
@@ -23,9 +23,16 @@ struct instr {
 		// comparison
 		IR_CEQ,
 
+		// selection
+		IR_SELECT, // followed by IR_EXTRA for when it holds and IR_EXTRA for when it doesn't
+
 		// extension
 		IR_ZEXT,
 
+		// ssa
+		IR_PHI, // followed by val pairs of IR_EXTRA label and IR_EXTRA temp
+		IR_COPY,
+
 		// glue
 		IR_ASSIGN,
 		IR_CALLARG,
@@ -41,12 +48,19 @@ struct instr {
 	} valtype;
 };
 
-struct iblock {
-	uint64_t start, end;
+#define NOBLOCK UINT64_MAX
+
+// a basic block, always starting with an IR_LABEL
+struct bblock {
+	uint64_t label;
+	uint64_t start, end; // instruction offsets in function
+	uint64_t idom; // immediate dominator
+	uint64_t rpo; // index in reverse postorder, NOBLOCK if unreachable
+	uint64_t depth; // number of loops the block is part of
 	struct {
 		size_t len, cap;
 		uint64_t *data;
-	} used;
+	} preds, succs, kids; // kids are the blocks it immediately dominates
 };
 
 struct temp {
@@ -58,20 +72,49 @@ struct temp {
 	} flags;
 	uint8_t size;
 	uint8_t reg;
-	uint64_t block;
+	enum {
+		SPILL_NONE,
+		SPILL_SLOT, // lives in memory at rbp + disp
+		SPILL_REMAT, // recomputed from its definition at every use
+	} spill;
+	int32_t disp;
+	uint64_t def; // offset of the defining instruction
+};
+
+// what is known about an argument from every call seen so far
+struct argval {
+	enum {
+		ARG_UNSEEN,
+		ARG_CONST,
+		ARG_VARIES,
+	} state;
+	uint64_t val;
+};
+
+// a call and the temporaries that are live across it
+struct callsite {
+	uint64_t pos;
+	uint64_t *live;
 };
 
 struct iproc {
 	size_t len;
 	size_t cap;
 	struct instr *data;
+	uint64_t frame; // bytes of stack for spilled temporaries
+	uint64_t nargs; // words of arguments every call pushes
 	uint64_t addr; // FIXME: 'addr' and 's' are only necessary because syscalls are intrinsics.
 	struct slice s; // Once syscalls are moved out, we can just use the decl fields and have a pointer to the declaration.
 	struct {
 		size_t len;
 		size_t cap;
-		struct iblock *data;
+		struct bblock *data;
 	} blocks;
+	struct {
+		size_t len;
+		size_t cap;
+		uint64_t *data; // reachable blocks in reverse postorder
+	} order;
 	struct {
 		size_t len;
 		size_t cap;
@@ -82,6 +125,20 @@ struct iproc {
 		size_t cap;
 		uint64_t *data; // instruction offset in function
 	} labels;
+	struct {
+		size_t words; // per set
+		uint64_t *in, *out; // one set of temporaries per block
+	} live;
+	struct {
+		size_t len;
+		size_t cap;
+		struct callsite *data; // in order of position
+	} calls;
+	struct {
+		size_t len;
+		size_t cap;
+		struct argval *data;
+	} args;
 };
 
 struct iprocs {
@@ -93,7 +150,12 @@ struct toplevel {
 	struct data data;
 	struct data text;
 	struct iprocs code;
+	struct map *procs; // name -> index in code + 1
 	uint64_t entry;
 };
 
 void genproc(struct stack *blockstack, struct iproc *const out, const struct proc *const proc);
+void geninit(struct stack *blockstack, struct iproc *const out, const struct decl *const decl);
+void optimize(struct iproc *const out);
+void addiproc(struct toplevel *const toplevel, const struct iproc *const iproc);
+struct iproc *findiproc(const struct toplevel *const toplevel, const struct slice *const s);
@@ -0,0 +1,308 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "bitset.h"
+#include "licm.h"
+
+#define NOPOS UINT64_MAX
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+static bool
+endsblock(const int op)
+{
+	return op == IR_JUMP || op == IR_RETURN;
+}
+
+// Make sure the only way into the loop from outside is through a block that
+// does nothing but go to the header, so that there is a place to put code
+// that should run once before the loop. If there isn't one already, a new
+// block is put right before the header, and the phis of the header get
+// their values from outside through phis of its own.
+static uint64_t
+preheader(struct iproc *const proc, const uint64_t h, const uint64_t *const body)
+{
+	const struct bblock *const header = &proc->blocks.data[h];
+	size_t outside = 0;
+	uint64_t pred = NOBLOCK;
+
+	for (size_t j = 0; j < header->preds.len; j++) {
+		if (!bstest(body, header->preds.data[j])) {
+			outside++;
+			pred = header->preds.data[j];
+		}
+	}
+
+	if (outside == 1 && proc->blocks.data[pred].succs.len == 1)
+		return proc->blocks.data[pred].label;
+
+	const uint64_t hlabel = header->label, l = newlabel(proc);
+	struct code code = { 0 };
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+
+		if (b == h) {
+			// a block of the loop falling into the header must not go
+			// through the preheader
+			if (b > 0 && bstest(body, b - 1) && !endsblock(proc->data[blocklast(proc, b - 1)].op))
+				put(&code, IR_JUMP, hlabel, VT_LABEL);
+			put(&code, IR_LABEL, l, VT_LABEL);
+
+			struct code phis = { 0 };
+			array_push((&phis), &proc->data[block->start], 1);
+			for (size_t i = block->start + 1; i < block->end; i += inslen(proc, i)) {
+				const struct instr *const ins = &proc->data[i];
+				if (ins->op != IR_ASSIGN || ins[1].op != IR_PHI) {
+					array_push((&phis), ins, block->end - i);
+					break;
+				}
+
+				const struct temp *const temp = &proc->temps.data[ins->val];
+				const uint64_t outer = outside > 1 ? newtemp(proc, temp->size, temp->flags) : 0;
+				struct code pairs = { 0 };
+
+				if (outer) {
+					put(&code, IR_ASSIGN, outer, VT_TEMP);
+					put(&code, IR_PHI, outside, VT_IMM);
+				}
+
+				for (size_t j = 0; j < ins[1].val; j++) {
+					const uint64_t from = labelblock(proc, ins[2 + 2*j].val);
+					if (bstest(body, from)) {
+						array_push((&pairs), &ins[2 + 2*j], 2);
+					} else if (outer) {
+						array_push((&code), &ins[2 + 2*j], 2);
+					} else {
+						put(&pairs, IR_EXTRA, l, VT_LABEL);
+						put(&pairs, IR_EXTRA, ins[3 + 2*j].val, VT_TEMP);
+					}
+				}
+
+				if (outer) {
+					put(&pairs, IR_EXTRA, l, VT_LABEL);
+					put(&pairs, IR_EXTRA, outer, VT_TEMP);
+				}
+
+				array_push((&phis), ins, 1);
+				put(&phis, IR_PHI, pairs.len / 2, VT_IMM);
+				array_push((&phis), pairs.data, pairs.len);
+				free(pairs.data);
+			}
+
+			array_push((&code), phis.data, phis.len);
+			free(phis.data);
+			continue;
+		}
+
+		array_push((&code), &proc->data[block->start], block->end - block->start);
+		if (bstest(body, b))
+			continue;
+
+		// jumps from outside go to the preheader instead
+		struct instr *const last = &code.data[code.len - (block->end - blocklast(proc, b))];
+		if ((last->op == IR_JUMP || last->op == IR_CONDJUMP) && last->val == hlabel)
+			last->val = l;
+	}
+
+	free(proc->data);
+	proc->data = code.data;
+	proc->len = code.len;
+	proc->cap = code.cap;
+	buildcfg(proc);
+
+	return l;
+}
+
+static bool
+ispure(const int op)
+{
+	switch (op) {
+	case IR_IMM:
+	case IR_ADD:
+	case IR_CEQ:
+	case IR_SELECT:
+	case IR_NOT:
+	case IR_ZEXT:
+	case IR_COPY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Move the computations of the loop with header h whose operands don't
+// change while it runs to its preheader. None of them can fault, so they
+// can be moved even if they don't run on every iteration. Loads can only
+// be moved if nothing in the loop writes to memory, and only from globals
+// and locals, which are always there to read.
+static void
+hoist(struct iproc *const proc, uint64_t h)
+{
+	const uint64_t hlabel = proc->blocks.data[h].label;
+	uint64_t *body = loopbody(proc, h);
+	const uint64_t prelabel = preheader(proc, h, body);
+
+	// the blocks may have moved
+	free(body);
+	h = labelblock(proc, hlabel);
+	body = loopbody(proc, h);
+	const uint64_t pre = labelblock(proc, prelabel);
+
+	uint64_t *const defblock = xmalloc(proc->temps.len * sizeof(*defblock));
+	uint64_t *const def = xmalloc(proc->temps.len * sizeof(*def));
+	bool *const invariant = xcalloc(proc->temps.len, sizeof(*invariant));
+	bool *const moved = xcalloc(proc->len, sizeof(*moved));
+	bool writes = false, any = false;
+
+	for (size_t t = 0; t < proc->temps.len; t++)
+		def[t] = defblock[t] = NOPOS;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const int op = proc->data[i].op;
+			if (op == IR_ASSIGN) {
+				def[proc->data[i].val] = i;
+				defblock[proc->data[i].val] = b;
+			}
+			if (bstest(body, b) && (op == IR_STORE || op == IR_CALL))
+				writes = true;
+		}
+	}
+
+	for (size_t k = 0; k < proc->order.len; k++) {
+		const uint64_t b = proc->order.data[k];
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (!bstest(body, b))
+			continue;
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const struct instr *const ins = &proc->data[i];
+			const size_t len = inslen(proc, i);
+			if (ins->op != IR_ASSIGN)
+				continue;
+
+			if (ins[1].op == IR_LOAD) {
+				const uint64_t addr = def[ins[1].val];
+				if (writes || addr == NOPOS || (proc->data[addr + 1].op != IR_IMM && proc->data[addr + 1].op != IR_ALLOC))
+					continue;
+			} else if (!ispure(ins[1].op)) {
+				continue;
+			}
+
+			bool ok = true;
+			for (size_t j = i + 1; j < i + len; j++) {
+				const uint64_t t = proc->data[j].val;
+				if (proc->data[j].valtype == VT_TEMP && !invariant[t] && (defblock[t] == NOPOS || bstest(body, defblock[t])))
+					ok = false;
+			}
+
+			if (ok) {
+				invariant[ins->val] = moved[i] = any = true;
+			}
+		}
+	}
+
+	if (any) {
+		struct code code = { 0 };
+		for (size_t b = 0; b < proc->blocks.len; b++) {
+			const struct bblock *const block = &proc->blocks.data[b];
+			const uint64_t last = blocklast(proc, b);
+			const bool term = proc->data[last].op == IR_JUMP;
+
+			for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+				if (b == pre && term && i == last)
+					break;
+				if (!moved[i])
+					array_push((&code), &proc->data[i], inslen(proc, i));
+			}
+
+			if (b != pre)
+				continue;
+
+			// in the order they were found in, so that every value is
+			// computed before it is used
+			for (size_t k = 0; k < proc->order.len; k++) {
+				const struct bblock *const from = &proc->blocks.data[proc->order.data[k]];
+				for (size_t i = from->start; i < from->end; i += inslen(proc, i)) {
+					if (moved[i])
+						array_push((&code), &proc->data[i], inslen(proc, i));
+				}
+			}
+
+			if (term)
+				array_push((&code), &proc->data[last], 1);
+		}
+
+		free(proc->data);
+		proc->data = code.data;
+		proc->len = code.len;
+		proc->cap = code.cap;
+		buildcfg(proc);
+	}
+
+	free(moved);
+	free(invariant);
+	free(def);
+	free(defblock);
+	free(body);
+}
+
+// Hoist loop invariant code out of every loop, starting with the innermost
+// ones, so that code moved out of one loop can move out of the loops around
+// it too.
+void
+licm(struct iproc *const proc)
+{
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} done = { 0 };
+
+	for (;;) {
+		uint64_t best = NOBLOCK;
+		for (size_t b = 0; b < proc->blocks.len; b++) {
+			const struct bblock *const block = &proc->blocks.data[b];
+			bool header = false, seen = false;
+
+			for (size_t j = 0; j < block->preds.len; j++) {
+				const uint64_t pred = block->preds.data[j];
+				header |= proc->blocks.data[pred].rpo != NOBLOCK && dominates(proc, b, pred);
+			}
+
+			for (size_t j = 0; j < done.len; j++)
+				seen |= done.data[j] == block->label;
+
+			if (header && !seen && (best == NOBLOCK || block->depth > proc->blocks.data[best].depth))
+				best = b;
+		}
+
+		if (best == NOBLOCK)
+			break;
+
+		array_add((&done), proc->blocks.data[best].label);
+		hoist(proc, best);
+	}
+
+	free(done.data);
+}
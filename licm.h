@@ -0,0 +1 @@
+void licm(struct iproc *const proc);
@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "bitset.h"
+#include "live.h"
+
+static void
+clearlive(struct iproc *const proc)
+{
+	free(proc->live.in);
+	free(proc->live.out);
+	for (size_t i = 0; i < proc->calls.len; i++)
+		free(proc->calls.data[i].live);
+	proc->calls.len = 0;
+}
+
+// Walk the instruction starting at i backwards, updating the set of
+// temporaries live before it from the set live after it.
+static void
+transfer(const struct iproc *const proc, const size_t i, uint64_t *const live)
+{
+	const size_t len = inslen(proc, i);
+	for (size_t j = i + len - 1; j >= i && j < i + len; j--) {
+		const struct instr *const ins = &proc->data[j];
+		assert(ins->op != IR_PHI);
+		if (ins->valtype != VT_TEMP)
+			continue;
+
+		if (ins->op == IR_ASSIGN)
+			bsclear(live, ins->val);
+		else
+			bsset(live, ins->val);
+	}
+}
+
+// Compute the temporaries live on entry to and exit from each block, as
+// well as those live across each call, which are the ones whose registers
+// have to be saved around it. The procedure must be out of SSA form.
+void
+liveness(struct iproc *const proc)
+{
+	const size_t nblocks = proc->blocks.len;
+	const size_t words = bswords(proc->temps.len);
+	uint64_t *const use = bsalloc(nblocks * words);
+	uint64_t *const def = bsalloc(nblocks * words);
+
+	clearlive(proc);
+	proc->live.words = words;
+	proc->live.in = bsalloc(nblocks * words);
+	proc->live.out = bsalloc(nblocks * words);
+
+	// the upward exposed uses and the definitions of each block only have
+	// to be found once
+	for (size_t b = 0; b < nblocks; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->end - 1; i >= block->start && i < block->end; i--) {
+			const struct instr *const ins = &proc->data[i];
+			if (ins->valtype != VT_TEMP)
+				continue;
+
+			if (ins->op == IR_ASSIGN) {
+				bsset(&def[b*words], ins->val);
+				bsclear(&use[b*words], ins->val);
+			} else {
+				bsset(&use[b*words], ins->val);
+			}
+		}
+	}
+
+	// in = use | (out & ~def), out = union of the successors' in, visited
+	// backwards since that is the direction the information flows in
+	uint64_t *const live = bsalloc(words);
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t b = nblocks - 1; b < nblocks; b--) {
+			const struct bblock *const block = &proc->blocks.data[b];
+			uint64_t *const out = &proc->live.out[b*words];
+
+			for (size_t j = 0; j < block->succs.len; j++)
+				bsunion(out, &proc->live.in[block->succs.data[j]*words], words);
+
+			bscopy(live, out, words);
+			bsdiff(live, &def[b*words], words);
+			bsunion(live, &use[b*words], words);
+			changed |= bsunion(&proc->live.in[b*words], live, words);
+		}
+	}
+
+	// the live-out set of each block, walked back to its calls
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} starts = { 0 };
+	for (size_t b = 0; b < nblocks; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		const size_t first = proc->calls.len;
+
+		starts.len = 0;
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i))
+			array_add((&starts), i);
+
+		bscopy(live, &proc->live.out[b*words], words);
+		for (size_t j = starts.len - 1; j < starts.len; j--) {
+			const uint64_t i = starts.data[j];
+			if (proc->data[i].op == IR_CALL) {
+				struct callsite call = { .pos = i, .live = bsalloc(words) };
+				bscopy(call.live, live, words);
+				array_add((&proc->calls), call);
+			}
+
+			transfer(proc, i, live);
+		}
+
+		// the calls of the block were found last to first
+		for (size_t j = 0; j < (proc->calls.len - first) / 2; j++) {
+			const struct callsite tmp = proc->calls.data[first + j];
+			proc->calls.data[first + j] = proc->calls.data[proc->calls.len - j - 1];
+			proc->calls.data[proc->calls.len - j - 1] = tmp;
+		}
+	}
+
+	free(starts.data);
+	free(live);
+	free(use);
+	free(def);
+}
+
+// the temporaries live after the call at pos
+const uint64_t *
+liveacross(const struct iproc *const proc, const uint64_t pos)
+{
+	size_t lo = 0, hi = proc->calls.len;
+
+	while (hi - lo > 1) {
+		const size_t mid = (lo + hi) / 2;
+		if (proc->calls.data[mid].pos <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	assert(lo < proc->calls.len && proc->calls.data[lo].pos == pos);
+	return proc->calls.data[lo].live;
+}
@@ -0,0 +1,2 @@
+void liveness(struct iproc *const proc);
+const uint64_t *liveacross(const struct iproc *const proc, const uint64_t pos);
@@ -0,0 +1,561 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "bitset.h"
+#include "mem2reg.h"
+#include "sccp.h"
+#include "dce.h"
+#include "indvar.h"
+#include "loop.h"
+
+#define NOPOS UINT64_MAX
+// the most instructions the test of a loop can have to be worth copying
+#define ROTATEMAX 16
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+struct list {
+	size_t len, cap;
+	uint64_t *data;
+};
+
+// A loop that can be rotated or unrolled: its header ends with the test that
+// leaves it for 'exit', and the one way back to the header is a jump at the
+// end of 'latch'.
+struct simpleloop {
+	uint64_t header, latch, exit;
+	uint64_t *body;
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+static void
+replace(struct iproc *const proc, const struct code *const code)
+{
+	free(proc->data);
+	proc->data = code->data;
+	proc->len = code->len;
+	proc->cap = code->cap;
+	buildcfg(proc);
+}
+
+static bool
+isphi(const struct iproc *const proc, const size_t i)
+{
+	return proc->data[i].op == IR_ASSIGN && proc->data[i + 1].op == IR_PHI;
+}
+
+static bool
+endsblock(const int op)
+{
+	return op == IR_JUMP || op == IR_RETURN;
+}
+
+static size_t
+blocksize(const struct iproc *const proc, const uint64_t b)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	size_t n = 0;
+
+	for (size_t i = block->start; i < block->end; i += inslen(proc, i))
+		n += proc->data[i].op != IR_LABEL;
+
+	return n;
+}
+
+// the number of instructions in the blocks of 'set'
+static size_t
+size(const struct iproc *const proc, const uint64_t *const set)
+{
+	size_t n = 0;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		if (bstest(set, b))
+			n += blocksize(proc, b);
+	}
+
+	return n;
+}
+
+static bool
+findloop(const struct iproc *const proc, const uint64_t h, struct simpleloop *const loop)
+{
+	const struct bblock *const header = &proc->blocks.data[h];
+	const struct instr *const test = &proc->data[blocklast(proc, h)];
+
+	*loop = (struct simpleloop){ .header = h, .latch = NOBLOCK, .exit = NOBLOCK };
+	if (header->rpo == NOBLOCK || test->op != IR_CONDJUMP || header->succs.len != 2)
+		return false;
+
+	for (size_t j = 0; j < header->preds.len; j++) {
+		const uint64_t pred = header->preds.data[j];
+		if (proc->blocks.data[pred].rpo == NOBLOCK || !dominates(proc, h, pred))
+			continue;
+		if (loop->latch != NOBLOCK)
+			return false;
+		loop->latch = pred;
+	}
+
+	if (loop->latch == NOBLOCK || loop->latch == h)
+		return false;
+
+	const struct instr *const back = &proc->data[blocklast(proc, loop->latch)];
+	if (back->op != IR_JUMP || back->val != header->label || test->val == header->label)
+		return false;
+
+	loop->body = loopbody(proc, h);
+	const bool in0 = bstest(loop->body, header->succs.data[0]), in1 = bstest(loop->body, header->succs.data[1]);
+	if (in0 == in1) {
+		free(loop->body);
+		loop->body = NULL;
+		return false;
+	}
+
+	loop->exit = header->succs.data[in0 ? 1 : 0];
+	return true;
+}
+
+static void
+atend(struct code *const code, const struct code *const loads, const struct code *const stores)
+{
+	if (loads->len)
+		array_push(code, loads->data, loads->len);
+	if (stores->len)
+		array_push(code, stores->data, stores->len);
+}
+
+// Make the values that the blocks in 'copied' share with the rest of the
+// procedure live in memory for a while: the phis of those blocks and of the
+// blocks they go to become stores at the end of each predecessor, and values
+// computed in them and used elsewhere are stored where they are computed and
+// loaded where they are used. Copies of the blocks then need no phis of
+// their own, and mem2reg puts back the ones that are needed. Nothing is
+// changed if a phi gets a value from a block going somewhere else as well,
+// where storing it could overwrite what another path still reads.
+static bool
+demote(struct iproc *const proc, const uint64_t *const copied)
+{
+	const size_t ntemps = proc->temps.len;
+	uint64_t *const defblock = xmalloc(ntemps * sizeof(*defblock));
+	uint64_t *const slot = xcalloc(ntemps, sizeof(*slot));
+	bool *const shared = xcalloc(ntemps, sizeof(*shared));
+	bool ok = true;
+
+	for (size_t t = 0; t < ntemps; t++)
+		defblock[t] = NOPOS;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		bool into = bstest(copied, b);
+
+		for (size_t j = 0; j < block->preds.len; j++)
+			into |= bstest(copied, block->preds.data[j]);
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const struct instr *const ins = &proc->data[i];
+			if (ins->op != IR_ASSIGN)
+				continue;
+
+			defblock[ins->val] = b;
+			if (!into || ins[1].op != IR_PHI)
+				continue;
+
+			shared[ins->val] = true;
+			for (size_t j = 0; j < ins[1].val; j++)
+				ok &= proc->blocks.data[labelblock(proc, ins[2 + 2*j].val)].succs.len == 1;
+		}
+	}
+
+	if (!ok) {
+		free(shared);
+		free(slot);
+		free(defblock);
+		return false;
+	}
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const size_t len = inslen(proc, i);
+			for (size_t j = i; j < i + len; j++) {
+				const struct instr *const ins = &proc->data[j];
+				if (ins->valtype != VT_TEMP || ins->op == IR_ASSIGN)
+					continue;
+
+				// a phi uses its values at the end of the blocks they
+				// come from
+				const uint64_t t = ins->val, use = isphi(proc, i) ? labelblock(proc, ins[-1].val) : b;
+				if (defblock[t] != NOPOS && bstest(copied, defblock[t]) && !bstest(copied, use))
+					shared[t] = true;
+			}
+		}
+	}
+
+	for (size_t t = 0; t < ntemps; t++) {
+		if (shared[t])
+			slot[t] = newtemp(proc, proc->temps.data[t].size, TF_PTR);
+	}
+
+	// what the phis need done at the end of each predecessor: first load
+	// every value, then store them, so that they still happen at once
+	struct code *const loads = xcalloc(proc->blocks.len, sizeof(*loads));
+	struct code *const stores = xcalloc(proc->blocks.len, sizeof(*stores));
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			struct instr *const ins = &proc->data[i];
+			if (!isphi(proc, i))
+				continue;
+
+			for (size_t j = 0; j < ins[1].val; j++) {
+				const uint64_t from = labelblock(proc, ins[2 + 2*j].val);
+				uint64_t v = ins[3 + 2*j].val;
+
+				if (slot[v]) {
+					const struct temp *const temp = &proc->temps.data[v];
+					const uint64_t u = newtemp(proc, temp->size, temp->flags);
+					put(&loads[from], IR_ASSIGN, u, VT_TEMP);
+					put(&loads[from], IR_LOAD, slot[v], VT_TEMP);
+					v = u;
+				}
+
+				if (slot[ins->val]) {
+					put(&stores[from], IR_STORE, v, VT_TEMP);
+					put(&stores[from], IR_EXTRA, slot[ins->val], VT_TEMP);
+				} else {
+					ins[3 + 2*j].val = v;
+				}
+			}
+		}
+	}
+
+	struct code code = { 0 };
+	struct list repl = { 0 };
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		const uint64_t last = blocklast(proc, b);
+		const int op = proc->data[last].op;
+		const bool term = endsblock(op) || op == IR_CONDJUMP;
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const struct instr *const ins = &proc->data[i];
+			const size_t len = inslen(proc, i);
+
+			if (ins->op == IR_LABEL) {
+				array_push((&code), ins, len);
+				for (size_t t = 0; b == 0 && t < ntemps; t++) {
+					if (!slot[t])
+						continue;
+					put(&code, IR_ASSIGN, slot[t], VT_TEMP);
+					put(&code, IR_ALLOC, 1, VT_IMM);
+				}
+				continue;
+			}
+
+			if (isphi(proc, i)) {
+				if (!slot[ins->val])
+					array_push((&code), ins, len);
+				continue;
+			}
+
+			if (i == last && term)
+				atend(&code, &loads[b], &stores[b]);
+
+			repl.len = 0;
+			for (size_t j = i; j < i + len; j++) {
+				const struct instr *const use = &proc->data[j];
+				if (use->valtype != VT_TEMP || use->op == IR_ASSIGN || !slot[use->val])
+					continue;
+
+				const struct temp *const temp = &proc->temps.data[use->val];
+				const uint64_t u = newtemp(proc, temp->size, temp->flags);
+				put(&code, IR_ASSIGN, u, VT_TEMP);
+				put(&code, IR_LOAD, slot[use->val], VT_TEMP);
+				array_add((&repl), u);
+			}
+
+			const size_t at = code.len;
+			array_push((&code), ins, len);
+			for (size_t j = at, k = 0; j < at + len; j++) {
+				struct instr *const use = &code.data[j];
+				if (use->valtype == VT_TEMP && use->op != IR_ASSIGN && slot[use->val])
+					use->val = repl.data[k++];
+			}
+
+			if (ins->op == IR_ASSIGN && slot[ins->val]) {
+				put(&code, IR_STORE, ins->val, VT_TEMP);
+				put(&code, IR_EXTRA, slot[ins->val], VT_TEMP);
+			}
+		}
+
+		if (!term)
+			atend(&code, &loads[b], &stores[b]);
+	}
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		free(loads[b].data);
+		free(stores[b].data);
+	}
+	free(loads);
+	free(stores);
+	free(repl.data);
+	free(shared);
+	free(slot);
+	free(defblock);
+
+	replace(proc, &code);
+	return true;
+}
+
+// Give every temporary defined in the blocks of 'set' a new one in 'temps'.
+static void
+freshtemps(struct iproc *const proc, const uint64_t *const set, uint64_t *const temps)
+{
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (!bstest(set, b))
+			continue;
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const uint64_t t = proc->data[i].val;
+			if (proc->data[i].op != IR_ASSIGN)
+				continue;
+
+			const struct temp *const temp = &proc->temps.data[t];
+			temps[t] = newtemp(proc, temp->size, temp->flags);
+		}
+	}
+}
+
+// Append a copy of block b labelled 'self' to code, using the temporaries in
+// 'temps' and going to the labels in 'labels' instead where they are set.
+// Where the block falls through, the copy jumps, since it is somewhere else.
+static void
+copyblock(const struct iproc *const proc, const uint64_t b, const uint64_t self, const uint64_t *const temps, const uint64_t *const labels, struct code *const code)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	const uint64_t last = blocklast(proc, b);
+
+	put(code, IR_LABEL, self, VT_LABEL);
+	for (size_t i = block->start + 1; i < block->end; i++) {
+		struct instr ins = proc->data[i];
+		if (ins.valtype == VT_TEMP && temps[ins.val])
+			ins.val = temps[ins.val];
+		else if (ins.valtype == VT_LABEL && labels[ins.val])
+			ins.val = labels[ins.val];
+		array_add(code, ins);
+	}
+
+	if (!endsblock(proc->data[last].op)) {
+		assert(b + 1 < proc->blocks.len);
+		const uint64_t next = proc->blocks.data[b + 1].label;
+		put(code, IR_JUMP, labels[next] ? labels[next] : next, VT_LABEL);
+	}
+}
+
+// Put 'n' copies of the loop in front of it, each going on to the next
+// instead of back to its own header, and the last one to the loop itself.
+static void
+peel(struct iproc *const proc, struct simpleloop *const loop, const uint64_t n)
+{
+	const uint64_t hlabel = proc->blocks.data[loop->header].label;
+
+	if (!demote(proc, loop->body))
+		return;
+
+	// the blocks may have moved
+	free(loop->body);
+	loop->header = labelblock(proc, hlabel);
+	loop->body = loopbody(proc, loop->header);
+
+	const uint64_t h = loop->header, *const body = loop->body;
+	const size_t ntemps = proc->temps.len;
+	uint64_t *const temps = xcalloc(ntemps, sizeof(*temps));
+	uint64_t *const labels = xcalloc(proc->labels.len, sizeof(*labels));
+	uint64_t *const first = xmalloc((n + 1) * sizeof(*first));
+	struct code code = { 0 };
+
+	for (uint64_t k = 0; k < n; k++)
+		first[k] = newlabel(proc);
+	first[n] = hlabel;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+
+		for (uint64_t k = 0; b == h && k < n; k++) {
+			memset(temps, 0, ntemps * sizeof(*temps));
+			freshtemps(proc, body, temps);
+			for (size_t c = 0; c < proc->blocks.len; c++) {
+				if (bstest(body, c) && c != h)
+					labels[proc->blocks.data[c].label] = newlabel(proc);
+			}
+			labels[hlabel] = first[k + 1];
+
+			copyblock(proc, h, first[k], temps, labels, &code);
+			for (size_t c = 0; c < proc->blocks.len; c++) {
+				if (bstest(body, c) && c != h)
+					copyblock(proc, c, labels[proc->blocks.data[c].label], temps, labels, &code);
+			}
+		}
+
+		array_push((&code), &proc->data[block->start], block->end - block->start);
+		const struct instr *const last = &proc->data[blocklast(proc, b)];
+
+		if (!bstest(body, b)) {
+			// coming from outside, the first copy runs first
+			struct instr *const jump = &code.data[code.len - (block->end - blocklast(proc, b))];
+			if ((jump->op == IR_JUMP || jump->op == IR_CONDJUMP) && jump->val == hlabel)
+				jump->val = first[0];
+		} else if (b + 1 == h && !endsblock(last->op)) {
+			put(&code, IR_JUMP, hlabel, VT_LABEL);
+		}
+	}
+
+	free(first);
+	free(labels);
+	free(temps);
+	replace(proc, &code);
+}
+
+// Copy the test at the top of the loop to the bottom, so that going around
+// again is a conditional jump back to the start of the body, rather than a
+// jump to the test and then a conditional jump into the body.
+static void
+rotateloop(struct iproc *const proc, struct simpleloop *const loop)
+{
+	const uint64_t hlabel = proc->blocks.data[loop->header].label;
+	const uint64_t latchlabel = proc->blocks.data[loop->latch].label;
+	const size_t words = bswords(proc->blocks.len);
+	uint64_t *const test = bsalloc(words);
+
+	bsset(test, loop->header);
+	if (!demote(proc, test)) {
+		free(test);
+		return;
+	}
+
+	const uint64_t h = labelblock(proc, hlabel), latch = labelblock(proc, latchlabel);
+	uint64_t *const temps = xcalloc(proc->temps.len, sizeof(*temps));
+	uint64_t *const labels = xcalloc(proc->labels.len, sizeof(*labels));
+	struct code code = { 0 };
+
+	memset(test, 0, words * sizeof(*test));
+	bsset(test, h);
+	freshtemps(proc, test, temps);
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (b != latch) {
+			array_push((&code), &proc->data[block->start], block->end - block->start);
+			continue;
+		}
+
+		// instead of jumping back to the header, fall into the copy
+		const uint64_t last = blocklast(proc, b);
+		assert(proc->data[last].op == IR_JUMP && proc->data[last].val == hlabel);
+		array_push((&code), &proc->data[block->start], last - block->start);
+		copyblock(proc, h, newlabel(proc), temps, labels, &code);
+	}
+
+	free(labels);
+	free(temps);
+	free(test);
+	replace(proc, &code);
+}
+
+// the deepest loop header that isn't in 'done', or NOBLOCK
+static uint64_t
+nextloop(const struct iproc *const proc, const struct list *const done)
+{
+	uint64_t best = NOBLOCK;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		bool header = false, seen = false;
+
+		for (size_t j = 0; j < block->preds.len; j++) {
+			const uint64_t pred = block->preds.data[j];
+			header |= proc->blocks.data[pred].rpo != NOBLOCK && dominates(proc, b, pred);
+		}
+
+		for (size_t j = 0; j < done->len; j++)
+			seen |= done->data[j] == block->label;
+
+		if (header && !seen && (best == NOBLOCK || block->depth > proc->blocks.data[best].depth))
+			best = b;
+	}
+
+	return best;
+}
+
+// Unroll the loops that run a number of times known in advance completely,
+// if all the copies of their bodies together are at most 'limit'
+// instructions, starting with the innermost ones. The loop is peeled that
+// many times, which leaves it where the last copy would go around again, and
+// sccp then finds which way each copy goes and that the loop is never
+// entered.
+void
+unroll(struct iproc *const proc, const size_t limit)
+{
+	struct list done = { 0 };
+	struct simpleloop loop;
+	uint64_t h, n;
+
+	while (limit && (h = nextloop(proc, &done)) != NOBLOCK) {
+		array_add((&done), proc->blocks.data[h].label);
+		if (!findloop(proc, h, &loop))
+			continue;
+
+		const size_t cost = size(proc, loop.body);
+		if (tripcount(proc, h, loop.exit, limit / cost, &n) && n) {
+			peel(proc, &loop, n);
+			mem2reg(proc);
+			sccp(proc, NULL, 0);
+			dce(proc);
+		}
+		free(loop.body);
+	}
+
+	free(done.data);
+}
+
+// Rotate every loop whose header tests whether to leave it and is small
+// enough to copy.
+void
+rotate(struct iproc *const proc)
+{
+	struct list done = { 0 };
+	struct simpleloop loop;
+	uint64_t h;
+
+	while ((h = nextloop(proc, &done)) != NOBLOCK) {
+		array_add((&done), proc->blocks.data[h].label);
+		if (!findloop(proc, h, &loop))
+			continue;
+
+		if (blocksize(proc, h) <= ROTATEMAX) {
+			rotateloop(proc, &loop);
+			mem2reg(proc);
+		}
+		free(loop.body);
+	}
+
+	free(done.data);
+}
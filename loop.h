@@ -0,0 +1,2 @@
+void unroll(struct iproc *const proc, const size_t limit);
+void rotate(struct iproc *const proc);
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -18,6 +19,15 @@
 #include "map.h"
 #include "target.h"
 #include "run.h"
+#include "fold.h"
+#include "reach.h"
+#include "cfg.h"
+#include "ssa.h"
+#include "regalloc.h"
+#include "sccp.h"
+#include "dce.h"
+#include "inline.h"
+#include "simplify.h"
 
 static struct stack blocks;
 struct assgns assgns;
@@ -26,6 +36,11 @@ struct target targ;
 struct toplevel toplevel;
 struct map *typesmap;
 char *infile;
+bool verbose;
+// procedures with at most this many instructions are inlined
+static size_t inlinethreshold = 16;
+// loops are unrolled if all the copies take at most this many instructions
+size_t unrolllimit = 64;
 
 struct block parse(const struct token *const start);
 struct token *lex(struct slice start);
@@ -54,10 +69,10 @@ void
 evalexpr(struct decl *const decl)
 {
 	struct expr *expr = &exprs.data[decl->val];
+	const struct type *const type = &types.data[decl->type];
 	if (expr->kind == EXPR_LIT) {
 		switch (expr->class) {
 		case C_INT: {
-			const struct type *const type = &types.data[decl->type];
 			data_set(decl->w.addr, &expr->d.v.v, type->size);
 			break;
 		}
@@ -69,27 +84,54 @@ evalexpr(struct decl *const decl)
 		default:
 			error(expr->start->line, expr->start->col, "genexpr: unknown value type!");
 		}
-	} else {
+	} else if (type->class == TYPE_ARRAY) {
 		error(expr->start->line, expr->start->col, "cannot evaluate expression at compile time");
+	} else {
+		// anything else is evaluated by interpreting it, which can call
+		// any procedure declared before this global
+		struct iproc init = { 0 };
+		geninit(&blocks, &init, decl);
+		runinit(&init, decl, type->size);
 	}
 }
 
+static void
+report(const char *const what, const struct slice *const s)
+{
+	if (verbose)
+		fprintf(stderr, "removed unreachable %s '%.*s'\n", what, (int)s->len, s->data);
+}
+
 void
 gentoplevel(struct toplevel *toplevel, const struct block *const block)
 {
 	char syscallname[] = "syscall0";
+	typecheck(block);
+	fold();
+	const uint8_t syscalls = reach(block);
 	stackpush(&blocks, block);
-	typecheck(&blocks, block);
 	struct iproc iproc = { 0 };
 	uint64_t curaddr = TEXT_OFFSET;
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} runtime = { 0 };
+	toplevel->procs = mkmap(16);
 
+	// stubs that aren't called still get an entry so that procedures only
+	// interpreted at compile time can refer to them
 	iproc.s = (struct slice){8, 8, syscallname};
 	for (int i = 1; i < 8; i++) {
 		syscallname[7]++;
 		iproc.s.data = strdup(syscallname);
-		iproc.addr = curaddr;
-		array_add((&toplevel->code), iproc);
-		curaddr += targ.emitsyscall(&toplevel->text, i);
+		iproc.addr = 0;
+		if (syscalls & (1 << i)) {
+			iproc.addr = curaddr;
+			curaddr += targ.emitsyscall(&toplevel->text, i);
+		} else {
+			report("syscall stub", &iproc.s);
+		}
+		addiproc(toplevel, &iproc);
 	}
 	for (int i = 0; i < block->len; i++) {
 		const struct statement *const statement = &block->data[i];
@@ -107,24 +149,37 @@ gentoplevel(struct toplevel *toplevel, const struct block *const block)
 			if (type->class == TYPE_PROC) {
 				assert(expr->class == C_PROC);
 				assert(expr->kind == EXPR_PROC);
+				if (!decl->reach) {
+					report("procedure", &decl->s);
+					break;
+				}
+
+				// the index is updated before generating the body, so
+				// that it can already refer to itself
 				iproc = (struct iproc){
 					.s = decl->s,
-					.addr = curaddr
 				};
-
-				if (slice_cmplit(&decl->s, "main") == 0)
-					toplevel->entry = curaddr;
+				addiproc(toplevel, &iproc);
+				struct iproc *const cur = &toplevel->code.data[toplevel->code.len - 1];
 
 				stackpush(&blocks, &expr->d.proc.block);
-				typecheck(&blocks, &expr->d.proc.block);
-				genproc(&blocks, &iproc, &expr->d.proc);
-				array_add((&toplevel->code), iproc);
-				curaddr += targ.emitproc(&toplevel->text, &iproc);
+				genproc(&blocks, cur, &expr->d.proc);
 				stackpop(&blocks);
+
+				// the rest are only needed to evaluate initializers,
+				// which interpret the SSA form directly
+				const uint64_t index = toplevel->code.len - 1;
+				if (decl->reach & REACH_RUNTIME)
+					array_add((&runtime), index);
 			} else {
 				if (slice_cmplit(&decl->s, "main") == 0)
 					die("global main must be procedure");
 
+				if (!decl->reach) {
+					report("global", &decl->s);
+					break;
+				}
+
 				if (type->class == TYPE_ARRAY) {
 					const struct type *const subtype = &types.data[type->d.arr.subtype];
 					decl->w.addr = data_pushzero(subtype->size * type->d.arr.len);
@@ -142,18 +197,104 @@ gentoplevel(struct toplevel *toplevel, const struct block *const block)
 
 	}
 	stackpop(&blocks);
+
+	size_t *const ncalls = xcalloc(toplevel->code.len, sizeof(*ncalls));
+	bool *const needed = xcalloc(toplevel->code.len, sizeof(*needed));
+
+	for (size_t i = 0; i < runtime.len; i++) {
+		const struct iproc *const cur = &toplevel->code.data[runtime.data[i]];
+		for (size_t j = 0; j < cur->len; j += inslen(cur, j)) {
+			if (cur->data[j].op == IR_CALL)
+				ncalls[cur->data[j].val]++;
+		}
+	}
+
+	// callees come first, so that what they inline is inlined with them
+	for (size_t i = 0; i < runtime.len; i++) {
+		struct iproc *const cur = &toplevel->code.data[runtime.data[i]];
+		if (inlinecalls(cur, ncalls, inlinethreshold)) {
+			optimize(cur);
+			ssacheck(cur);
+		}
+	}
+
+	// Procedures can only call the ones declared before them, so going
+	// backwards every caller is seen before its callees, and each can be
+	// specialized for the arguments that are the same at all its calls.
+	// Those that were inlined everywhere are never called at all.
+	for (size_t i = runtime.len - 1; i < runtime.len; i--) {
+		struct iproc *const cur = &toplevel->code.data[runtime.data[i]];
+		if (slice_cmplit(&cur->s, "main") != 0 && !needed[runtime.data[i]]) {
+			report("inlined procedure", &cur->s);
+			continue;
+		}
+
+		needed[runtime.data[i]] = true;
+		sccp(cur, cur->args.data, cur->args.len);
+		dce(cur);
+		simplifycfg(cur);
+		callargs(cur);
+		for (size_t j = 0; j < cur->len; j += inslen(cur, j)) {
+			if (cur->data[j].op == IR_CALL)
+				needed[cur->data[j].val] = true;
+		}
+	}
+
+	for (size_t i = 0; i < runtime.len; i++) {
+		struct iproc *const cur = &toplevel->code.data[runtime.data[i]];
+		if (!needed[runtime.data[i]])
+			continue;
+
+		ssadestruct(cur);
+		chooseregs(cur);
+		if (slice_cmplit(&cur->s, "main") == 0)
+			toplevel->entry = curaddr;
+
+		cur->addr = curaddr;
+		curaddr += targ.emitproc(&toplevel->text, cur);
+	}
+
+	free(needed);
+	free(ncalls);
+	free(runtime.data);
+}
+
+static int
+usage(const char *const name)
+{
+	fprintf(stderr, "usage: %s [-v] [--inline-threshold n] [--unroll-limit n] input [output]\n", name);
+	return 1;
 }
 
 int
 main(int argc, char *argv[])
 {
+	char *output;
+	int argi = 1;
 	targ = x64_target;
-	if (argc != 2) {
-		fprintf(stderr, "exactly 1 argument allowed\n");
-		return 1;
+
+	for (; argi < argc && argv[argi][0] == '-'; argi++) {
+		char *end;
+		if (strcmp(argv[argi], "-v") == 0) {
+			verbose = true;
+		} else if (strcmp(argv[argi], "--inline-threshold") == 0 && argi + 1 < argc) {
+			inlinethreshold = strtoull(argv[++argi], &end, 10);
+			if (*end || !*argv[argi])
+				return usage(argv[0]);
+		} else if (strcmp(argv[argi], "--unroll-limit") == 0 && argi + 1 < argc) {
+			unrolllimit = strtoull(argv[++argi], &end, 10);
+			if (*end || !*argv[argi])
+				return usage(argv[0]);
+		} else {
+			return usage(argv[0]);
+		}
 	}
 
-	infile = argv[1];
+	if (argc - argi != 1 && argc - argi != 2)
+		return usage(argv[0]);
+
+	infile = argv[argi];
+	output = argc - argi == 2 ? argv[argi + 1] : NULL;
 	const int in = open(infile, 0, O_RDONLY);
 	if (in < 0) {
 		fprintf(stderr, "couldn't open input\n");
@@ -182,6 +323,22 @@ main(int argc, char *argv[])
 
 	gentoplevel(&toplevel, &statements);
 
-	run(&toplevel);
+	// without an output file, interpret the program instead
+	if (!output) {
+		run(&toplevel);
+		munmap(addr, statbuf.st_size);
+		return 0;
+	}
+
+	FILE *const out = fopen(output, "w");
+	if (!out) {
+		munmap(addr, statbuf.st_size);
+		fprintf(stderr, "couldn't open output\n");
+		return 1;
+	}
+
+	elf(toplevel.entry, &toplevel.text, &toplevel.data, out);
+
+	fclose(out);
 	munmap(addr, statbuf.st_size);
 }
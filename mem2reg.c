@@ -0,0 +1,360 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "bitset.h"
+#include "mem2reg.h"
+
+#define NOVAR UINT64_MAX
+#define NOPHI UINT64_MAX
+
+struct phi {
+	uint64_t var, temp;
+	uint64_t next; // the next phi of the same block
+	uint64_t *args; // one per predecessor
+};
+
+struct promote {
+	uint64_t *var; // temp -> promoted variable, if it is the address of one
+	uint64_t *vartemp; // variable -> temp holding its address
+	size_t nvars;
+	struct {
+		size_t len, cap;
+		struct phi *data;
+	} phis;
+	uint64_t *blockphis; // first phi of each block
+	uint64_t *repl; // loads that were replaced by the value they read
+	uint64_t undef;
+	bool needundef;
+};
+
+// An allocation can live in a register instead if its address is only ever
+// loaded from and stored to, with the width of the variable. Anything else,
+// like taking it with '$x' or passing it as the place to put a result, lets
+// the address escape.
+static void
+findvars(struct promote *const p, struct iproc *const proc)
+{
+	bool *const escapes = xcalloc(proc->temps.len, sizeof(*escapes));
+
+	p->var = xmalloc(proc->temps.len * sizeof(*p->var));
+	for (size_t t = 0; t < proc->temps.len; t++)
+		p->var[t] = NOVAR;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		const struct instr *const ins = &proc->data[i];
+		if (ins->op == IR_ASSIGN && ins[1].op == IR_ALLOC && ins[1].val == 1)
+			p->var[ins->val] = 0;
+	}
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		const size_t len = inslen(proc, i);
+		for (size_t j = i; j < i + len; j++) {
+			const struct instr *const ins = &proc->data[j];
+			if (ins->valtype != VT_TEMP || ins->op == IR_ASSIGN || p->var[ins->val] == NOVAR)
+				continue;
+
+			const uint8_t size = proc->temps.data[ins->val].size;
+			if (j == i + 1 && ins->op == IR_LOAD && proc->temps.data[proc->data[i].val].size == size)
+				continue;
+			if (j == i + 1 && proc->data[i].op == IR_STORE)
+				continue;
+
+			escapes[ins->val] = true;
+		}
+	}
+
+	p->vartemp = xmalloc(proc->temps.len * sizeof(*p->vartemp));
+	for (size_t t = 0; t < proc->temps.len; t++) {
+		if (p->var[t] == NOVAR)
+			continue;
+
+		if (escapes[t]) {
+			p->var[t] = NOVAR;
+			continue;
+		}
+
+		p->var[t] = p->nvars;
+		p->vartemp[p->nvars++] = t;
+	}
+
+	free(escapes);
+}
+
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy again:
+// a join point is in the dominance frontier of every block on the way up the
+// dominator tree from each of its predecessors to its immediate dominator.
+static uint64_t *
+frontiers(const struct iproc *const proc, const size_t words)
+{
+	uint64_t *const df = bsalloc(proc->blocks.len * words);
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (block->rpo == NOBLOCK || block->preds.len < 2)
+			continue;
+
+		for (size_t j = 0; j < block->preds.len; j++) {
+			uint64_t runner = block->preds.data[j];
+			if (proc->blocks.data[runner].rpo == NOBLOCK)
+				continue;
+
+			while (runner != block->idom) {
+				bsset(&df[runner*words], b);
+				if (runner == 0)
+					break;
+				runner = proc->blocks.data[runner].idom;
+			}
+		}
+	}
+
+	return df;
+}
+
+// Put a phi for each variable at the iterated dominance frontier of the
+// blocks that store to it.
+static void
+placephis(struct promote *const p, struct iproc *const proc)
+{
+	const size_t nblocks = proc->blocks.len, words = bswords(nblocks);
+	uint64_t *const df = frontiers(proc, words);
+	uint64_t *const stores = bsalloc(p->nvars * words);
+	uint64_t *const hasphi = bsalloc(words), *const queued = bsalloc(words);
+	struct {
+		size_t len, cap;
+		uint64_t *data;
+	} work = { 0 };
+
+	for (size_t b = 0; b < nblocks; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const struct instr *const ins = &proc->data[i];
+			if (ins->op == IR_STORE && p->var[ins[1].val] != NOVAR)
+				bsset(&stores[p->var[ins[1].val]*words], b);
+		}
+	}
+
+	p->blockphis = xmalloc(nblocks * sizeof(*p->blockphis));
+	for (size_t b = 0; b < nblocks; b++)
+		p->blockphis[b] = NOPHI;
+
+	for (size_t v = 0; v < p->nvars; v++) {
+		const uint64_t *const s = &stores[v*words];
+		memset(hasphi, 0, words * sizeof(*hasphi));
+		bscopy(queued, s, words);
+		work.len = 0;
+		for (size_t b = bsnext(s, words, 0); b != BSNONE; b = bsnext(s, words, b + 1))
+			array_add((&work), b);
+
+		while (work.len) {
+			const uint64_t *const f = &df[work.data[--work.len]*words];
+			for (size_t b = bsnext(f, words, 0); b != BSNONE; b = bsnext(f, words, b + 1)) {
+				if (bstest(hasphi, b))
+					continue;
+
+				const struct temp *const var = &proc->temps.data[p->vartemp[v]];
+				struct phi phi = {
+					.var = v,
+					.temp = newtemp(proc, var->size, TF_INT),
+					.next = p->blockphis[b],
+					.args = xcalloc(proc->blocks.data[b].preds.len, sizeof(uint64_t)),
+				};
+				array_add((&p->phis), phi);
+				p->blockphis[b] = p->phis.len - 1;
+				bsset(hasphi, b);
+
+				if (!bstest(queued, b)) {
+					bsset(queued, b);
+					array_add((&work), b);
+				}
+			}
+		}
+	}
+
+	free(work.data);
+	free(queued);
+	free(hasphi);
+	free(stores);
+	free(df);
+}
+
+static uint64_t
+current(struct promote *const p, const uint64_t *const cur, const uint64_t v)
+{
+	if (cur[v])
+		return cur[v];
+
+	// reading a variable before it is written gives zero, like reading
+	// the memory of a fresh allocation
+	p->needundef = true;
+	return p->undef;
+}
+
+static uint64_t
+resolve(const struct promote *const p, uint64_t t)
+{
+	while (p->repl[t])
+		t = p->repl[t];
+
+	return t;
+}
+
+// Walk the dominator tree, replacing each load with the value most recently
+// stored to the variable, and filling in the phis of the successors on the
+// way. 'cur' holds the current value of each variable and is restored before
+// returning.
+static void
+renamevars(struct promote *const p, struct iproc *const proc, const uint64_t b, uint64_t *const cur)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	uint64_t *const saved = xmalloc((p->nvars ? p->nvars : 1) * sizeof(*saved));
+	memcpy(saved, cur, p->nvars * sizeof(*cur));
+
+	for (uint64_t phi = p->blockphis[b]; phi != NOPHI; phi = p->phis.data[phi].next)
+		cur[p->phis.data[phi].var] = p->phis.data[phi].temp;
+
+	for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+		struct instr *const ins = &proc->data[i];
+		uint64_t v;
+
+		if (ins->op == IR_STORE && (v = p->var[ins[1].val]) != NOVAR) {
+			cur[v] = resolve(p, ins->val);
+			inskill(proc, i);
+		} else if (ins->op == IR_ASSIGN && ins[1].op == IR_ALLOC && p->var[ins->val] != NOVAR) {
+			inskill(proc, i);
+		} else if (ins->op == IR_ASSIGN && ins[1].op == IR_LOAD && (v = p->var[ins[1].val]) != NOVAR) {
+			const uint64_t val = current(p, cur, v);
+			const uint8_t from = proc->temps.data[val].size, to = proc->temps.data[ins->val].size;
+			// a load wider than the value stored reads it zero-extended,
+			// and a narrower one keeps a copy of its own that only means
+			// the low bytes of it
+			if (from == to) {
+				p->repl[ins->val] = val;
+				inskill(proc, i);
+			} else {
+				ins[1] = (struct instr){ .op = from < to ? IR_ZEXT : IR_COPY, .val = val, .valtype = VT_TEMP };
+			}
+		}
+	}
+
+	for (size_t j = 0; j < block->succs.len; j++) {
+		const struct bblock *const succ = &proc->blocks.data[block->succs.data[j]];
+		for (uint64_t phi = p->blockphis[block->succs.data[j]]; phi != NOPHI; phi = p->phis.data[phi].next) {
+			for (size_t k = 0; k < succ->preds.len; k++) {
+				if (succ->preds.data[k] == b)
+					p->phis.data[phi].args[k] = current(p, cur, p->phis.data[phi].var);
+			}
+		}
+	}
+
+	for (size_t j = 0; j < block->kids.len; j++)
+		renamevars(p, proc, block->kids.data[j], cur);
+
+	memcpy(cur, saved, p->nvars * sizeof(*cur));
+	free(saved);
+}
+
+// Put the phis at the start of their blocks and the definition of the value
+// of variables read before they are written at the start of the procedure.
+static void
+rewrite(struct promote *const p, struct iproc *const proc)
+{
+	struct {
+		size_t len, cap;
+		struct instr *data;
+	} code = { 0 };
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		array_push((&code), &proc->data[block->start], 1);
+
+		if (b == 0 && p->needundef) {
+			const struct instr def[] = {
+				{ .op = IR_ASSIGN, .val = p->undef, .valtype = VT_TEMP },
+				{ .op = IR_IMM, .val = 0, .valtype = VT_IMM },
+			};
+			array_push((&code), def, 2);
+		}
+
+		for (uint64_t phi = p->blockphis[b]; phi != NOPHI; phi = p->phis.data[phi].next) {
+			const struct instr head[] = {
+				{ .op = IR_ASSIGN, .val = p->phis.data[phi].temp, .valtype = VT_TEMP },
+				{ .op = IR_PHI, .val = block->preds.len, .valtype = VT_IMM },
+			};
+			array_push((&code), head, 2);
+
+			for (size_t k = 0; k < block->preds.len; k++) {
+				assert(p->phis.data[phi].args[k]);
+				const struct instr pair[] = {
+					{ .op = IR_EXTRA, .val = proc->blocks.data[block->preds.data[k]].label, .valtype = VT_LABEL },
+					{ .op = IR_EXTRA, .val = resolve(p, p->phis.data[phi].args[k]), .valtype = VT_TEMP },
+				};
+				array_push((&code), pair, 2);
+			}
+		}
+
+		array_push((&code), &proc->data[block->start + 1], block->end - block->start - 1);
+	}
+
+	free(proc->data);
+	proc->data = code.data;
+	proc->len = code.len;
+	proc->cap = code.cap;
+
+	for (size_t i = 0; i < proc->len; i++) {
+		struct instr *const ins = &proc->data[i];
+		if (ins->valtype == VT_TEMP && ins->op != IR_ASSIGN)
+			ins->val = resolve(p, ins->val);
+	}
+}
+
+// Promote the local variables whose address never escapes from memory to
+// temporaries, building SSA form for them with the algorithm of Cytron et
+// al.: phis go at the iterated dominance frontier of the stores, and a walk
+// of the dominator tree connects every load with the store it reads.
+void
+mem2reg(struct iproc *const proc)
+{
+	struct promote p = { 0 };
+
+	findvars(&p, proc);
+	if (!p.nvars) {
+		free(p.var);
+		free(p.vartemp);
+		return;
+	}
+
+	placephis(&p, proc);
+
+	p.undef = newtemp(proc, 8, TF_INT);
+	p.repl = xcalloc(proc->temps.len, sizeof(*p.repl));
+	uint64_t *const cur = xcalloc(p.nvars, sizeof(*cur));
+	renamevars(&p, proc, 0, cur);
+
+	// blocks that can't be reached still have to make sense on their own
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		if (proc->blocks.data[b].rpo == NOBLOCK)
+			renamevars(&p, proc, b, cur);
+	}
+
+	rewrite(&p, proc);
+
+	for (size_t i = 0; i < p.phis.len; i++)
+		free(p.phis.data[i].args);
+	free(p.phis.data);
+	free(cur);
+	free(p.repl);
+	free(p.blockphis);
+	free(p.vartemp);
+	free(p.var);
+
+	buildcfg(proc);
+}
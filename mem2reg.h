@@ -0,0 +1 @@
+void mem2reg(struct iproc *const proc);
@@ -1,5 +1,5 @@
 #define TEXT_OFFSET 0x101000
-#define DATA_OFFSET 0x102000
+#define DATA_OFFSET 0x40000000
 
 #define BLOCKSTACKSIZE 32
 
@@ -125,6 +125,7 @@ struct decl {
 	bool in;
 	bool out;
 	bool toplevel;
+	uint8_t reach;
 	uint64_t index;
 
 	union {
@@ -261,6 +262,18 @@ struct exprs {
 	struct expr *data;
 };
 
+struct diag {
+	size_t line, col;
+	size_t seq; // position in the emitting job, keeps sorting stable
+	char *msg;
+};
+
+struct diags {
+	size_t cap;
+	size_t len;
+	struct diag *data;
+};
+
 extern const char *const tokenstr[];
 extern struct assgns assgns;
 extern struct exprs exprs;
@@ -268,4 +281,6 @@ extern struct target targ;
 extern struct toplevel toplevel;
 extern struct map *typesmap;
 extern char *infile;
+extern bool verbose;
+extern size_t unrolllimit;
 extern struct types types;
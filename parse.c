@@ -406,8 +406,17 @@ parseblock(struct block *const block)
 			if (finddecl(&blocks, decl.s))
 				error(tok->line, tok->col, "repeat declaration!");
 
+			// a procedure can call itself, so it is declared before
+			// its body is parsed
+			const bool isproc = types.data[decl.type].class == TYPE_PROC;
+			if (isproc)
+				array_add((&block->decls), decl);
+
 			decl.val = parseexpr(block);
-			array_add((&block->decls), decl);
+			if (isproc)
+				block->decls.data[block->decls.len - 1].val = decl.val;
+			else
+				array_add((&block->decls), decl);
 
 			statement.idx = block->decls.len - 1;
 			array_add(block, statement);
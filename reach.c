@@ -0,0 +1,161 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "reach.h"
+
+static const struct block *toplevelblock;
+static uint8_t syscalls;
+
+static void markproc(struct decl *const decl, const uint8_t mode);
+static void markglobal(struct decl *const decl);
+static void walkblock(struct stack *const blocks, const struct block *const block, const uint8_t mode);
+
+static void
+markname(struct stack *const blocks, const struct slice s)
+{
+	struct decl *const decl = finddecl(blocks, s);
+	if (decl && decl->toplevel)
+		markglobal(decl);
+}
+
+static void
+walkexpr(struct stack *const blocks, const size_t expri, const uint8_t mode)
+{
+	const struct expr *const expr = &exprs.data[expri];
+	struct decl *decl;
+
+	switch (expr->kind) {
+	case EXPR_LIT:
+	case EXPR_PROC:
+		break;
+	case EXPR_IDENT:
+		markname(blocks, expr->d.s);
+		break;
+	case EXPR_BINARY:
+		walkexpr(blocks, expr->d.bop.left, mode);
+		walkexpr(blocks, expr->d.bop.right, mode);
+		break;
+	case EXPR_UNARY:
+		walkexpr(blocks, expr->d.uop.expr, mode);
+		break;
+	case EXPR_ACCESS:
+		walkexpr(blocks, expr->d.access.array, mode);
+		break;
+	case EXPR_FCALL:
+		for (size_t i = 0; i < expr->d.call.params.len; i++)
+			walkexpr(blocks, expr->d.call.params.data[i], mode);
+
+		decl = finddecl(blocks, expr->d.call.name);
+		if (decl) {
+			markproc(decl, mode);
+		} else if (mode == REACH_RUNTIME && expr->d.call.name.len == 8) {
+			// syscall intrinsics don't have declarations
+			syscalls |= 1 << (expr->d.call.name.data[7] - '0');
+		}
+		break;
+	case EXPR_COND:
+		walkexpr(blocks, expr->d.cond.cond, mode);
+		walkblock(blocks, &expr->d.cond.bif, mode);
+		walkblock(blocks, &expr->d.cond.belse, mode);
+		break;
+	case EXPR_LOOP:
+		walkblock(blocks, &expr->d.loop.block, mode);
+		break;
+	default:
+		die("reach: walkexpr: bad expr kind");
+	}
+}
+
+static void
+walkblock(struct stack *const blocks, const struct block *const block, const uint8_t mode)
+{
+	stackpush(blocks, block);
+	for (size_t i = 0; i < block->len; i++) {
+		const struct statement *const statement = &block->data[i];
+		switch (statement->kind) {
+		case STMT_DECL:
+			walkexpr(blocks, block->decls.data[statement->idx].val, mode);
+			break;
+		case STMT_ASSGN:
+			markname(blocks, assgns.data[statement->idx].s);
+			walkexpr(blocks, assgns.data[statement->idx].val, mode);
+			break;
+		case STMT_EXPR:
+			walkexpr(blocks, statement->idx, mode);
+			break;
+		case STMT_RETURN:
+		case STMT_BREAK:
+			break;
+		default:
+			die("reach: walkblock: unreachable");
+		}
+	}
+	stackpop(blocks);
+}
+
+// Procedures called at runtime are emitted, procedures only called while
+// evaluating global initializers just need their IR.
+static void
+markproc(struct decl *const decl, const uint8_t mode)
+{
+	if (decl->reach & (mode | REACH_RUNTIME))
+		return;
+
+	decl->reach |= mode;
+	struct stack blocks = { 0 };
+	stackpush(&blocks, toplevelblock);
+	walkblock(&blocks, &exprs.data[decl->val].d.proc.block, mode);
+	free(blocks.data);
+}
+
+// Globals are kept whenever anything refers to them, even if only at
+// compile time, since initializers read them from the data segment.
+static void
+markglobal(struct decl *const decl)
+{
+	if (decl->reach)
+		return;
+
+	decl->reach = REACH_RUNTIME;
+	if (exprs.data[decl->val].kind == EXPR_PROC) {
+		decl->reach = 0;
+		markproc(decl, REACH_RUNTIME);
+		return;
+	}
+
+	struct stack blocks = { 0 };
+	stackpush(&blocks, toplevelblock);
+	walkexpr(&blocks, decl->val, REACH_COMPILE);
+	free(blocks.data);
+}
+
+// Mark every toplevel declaration reachable from main and return the set
+// of syscall stubs used, indexed by their parameter count.
+uint8_t
+reach(const struct block *const block)
+{
+	struct decl *entry = NULL;
+	toplevelblock = block;
+	syscalls = 0;
+
+	for (size_t i = 0; i < block->decls.len; i++) {
+		if (slice_cmplit(&block->decls.data[i].s, "main") == 0)
+			entry = &block->decls.data[i];
+	}
+
+	// without an entry point there is nothing to measure against
+	if (entry == NULL || exprs.data[entry->val].kind != EXPR_PROC) {
+		for (size_t i = 0; i < block->decls.len; i++)
+			block->decls.data[i].reach = REACH_RUNTIME;
+
+		return 0xFE;
+	}
+
+	markproc(entry, REACH_RUNTIME);
+	return syscalls;
+}
@@ -0,0 +1,6 @@
+enum {
+	REACH_COMPILE = 1,
+	REACH_RUNTIME = 2,
+};
+
+uint8_t reach(const struct block *const block);
@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "target.h"
+#include "cfg.h"
+#include "bitset.h"
+#include "live.h"
+#include "regalloc.h"
+
+#define NOPOS UINT64_MAX
+
+// the end of the last interval using each stack slot
+struct slots {
+	size_t len, cap;
+	uint64_t *data;
+};
+
+static void
+extend(struct temp *const temp, const uint64_t pos)
+{
+	if (temp->start == NOPOS || pos < temp->start)
+		temp->start = pos;
+	if (temp->end == NOPOS || pos > temp->end)
+		temp->end = pos;
+}
+
+// A live interval covers every instruction at which its temporary is live.
+// Intervals have no holes, so each is just the hull of those positions.
+static void
+intervals(struct iproc *const proc)
+{
+	liveness(proc);
+
+	const size_t words = proc->live.words;
+
+	for (size_t t = 0; t < proc->temps.len; t++)
+		proc->temps.data[t].start = proc->temps.data[t].end = NOPOS;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		const uint64_t *const in = &proc->live.in[b*words], *const out = &proc->live.out[b*words];
+
+		for (size_t t = bsnext(in, words, 0); t != BSNONE; t = bsnext(in, words, t + 1))
+			extend(&proc->temps.data[t], block->start);
+		for (size_t t = bsnext(out, words, 0); t != BSNONE; t = bsnext(out, words, t + 1))
+			extend(&proc->temps.data[t], block->end - 1);
+
+		for (size_t i = block->start; i < block->end; i++) {
+			if (proc->data[i].valtype == VT_TEMP)
+				extend(&proc->temps.data[proc->data[i].val], i);
+		}
+	}
+}
+
+static const struct iproc *sorting;
+
+static int
+bystart(const void *const a, const void *const b)
+{
+	const struct temp *const ta = &sorting->temps.data[*(const uint64_t *)a];
+	const struct temp *const tb = &sorting->temps.data[*(const uint64_t *)b];
+	return (ta->start > tb->start) - (ta->start < tb->start);
+}
+
+// How much keeping a temporary in memory would cost, per instruction of its
+// interval. Every use or definition counts for more the deeper the loop it
+// is in, and immediates are cheap because they never have to be stored.
+static double *
+spillcosts(struct iproc *const proc)
+{
+	double *const cost = xcalloc(proc->temps.len, sizeof(*cost));
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		const double weight = 1 << (3 * (block->depth < 6 ? block->depth : 6));
+		for (size_t i = block->start; i < block->end; i++) {
+			const struct instr *const ins = &proc->data[i];
+			if (ins->valtype != VT_TEMP)
+				continue;
+
+			cost[ins->val] += weight;
+			if (ins->op == IR_ASSIGN)
+				proc->temps.data[ins->val].def = i;
+		}
+	}
+
+	for (size_t t = 1; t < proc->temps.len; t++) {
+		const struct temp *const temp = &proc->temps.data[t];
+		if (temp->start == NOPOS)
+			continue;
+
+		if (proc->data[temp->def + 1].op == IR_IMM)
+			cost[t] /= 2;
+		cost[t] /= temp->end - temp->start + 1;
+	}
+
+	return cost;
+}
+
+// Temporaries living in memory get a slot of their own in the frame, unless
+// it can be shared with one whose interval ended before. Parameters already
+// have a slot, which is where the caller put them.
+static void
+spill(struct iproc *const proc, struct temp *const temp, struct slots *const slots)
+{
+	size_t slot = 0;
+
+	switch (proc->data[temp->def + 1].op) {
+	case IR_IMM:
+		temp->spill = SPILL_REMAT;
+		return;
+	case IR_IN:
+		temp->spill = SPILL_SLOT;
+		temp->disp = 16 + 8 * proc->data[temp->def + 1].val;
+		return;
+	default:
+		temp->spill = SPILL_SLOT;
+	}
+
+	for (; slot < slots->len; slot++) {
+		if (slots->data[slot] < temp->start)
+			break;
+	}
+
+	if (slot == slots->len)
+		array_add(slots, temp->end);
+
+	slots->data[slot] = temp->end;
+	temp->disp = -8 * (int32_t)(slot + 1);
+	if (proc->frame < 8 * (slot + 1))
+		proc->frame = 8 * (slot + 1);
+}
+
+// The operand of the instruction defining t that is used for the last time
+// there, so that t can take over its register and the target need not move
+// anything to compute t in place. The left operand is preferred over the
+// right one, and immediates are left alone since they often don't need a
+// register at all. Returns where the operand is in 'active', or nactive.
+static size_t
+dyingoperand(const struct iproc *const proc, const uint64_t *const active, const size_t nactive, const uint64_t t)
+{
+	const struct temp *const temp = &proc->temps.data[t];
+	const struct instr *const ins = &proc->data[temp->start];
+	size_t first = 1, last;
+
+	if (ins->op != IR_ASSIGN || ins->val != t)
+		return nactive;
+
+	switch (ins[1].op) {
+	case IR_NOT:
+	case IR_ZEXT:
+	case IR_COPY:
+	case IR_LOAD:
+		last = 1;
+		break;
+	case IR_ADD:
+	case IR_CEQ:
+		last = 2;
+		break;
+	case IR_SELECT:
+		// either of the values, but not the condition
+		first = 2;
+		last = 3;
+		break;
+	default:
+		return nactive;
+	}
+
+	for (size_t j = first; j <= last; j++) {
+		const struct temp *const operand = &proc->temps.data[ins[j].val];
+		if (operand->end > temp->start + last || proc->data[operand->def + 1].op == IR_IMM)
+			continue;
+
+		for (size_t k = 0; k < nactive; k++) {
+			if (active[k] == ins[j].val)
+				return k;
+		}
+	}
+
+	return nactive;
+}
+
+// Linear scan register allocation, after Poletto and Sarkar. Intervals are
+// visited in order of their start, and the active ones are kept sorted by
+// their end so that the expired ones are always at the front. When all
+// registers are taken, whichever of the active intervals and the new one is
+// the cheapest to keep in memory is spilled for its whole length. A result
+// whose operand dies where it is computed gets the register of that operand,
+// which makes copies between them disappear.
+void
+chooseregs(struct iproc *const proc)
+{
+	uint64_t active[16];
+	size_t nactive = 0, count = 0;
+	uint16_t regs = targ.reserved;
+	uint64_t *const order = xmalloc(proc->temps.len * sizeof(*order));
+	struct slots slots = { 0 };
+
+	intervals(proc);
+	double *const cost = spillcosts(proc);
+
+	for (size_t t = 1; t < proc->temps.len; t++) {
+		if (proc->temps.data[t].start != NOPOS)
+			order[count++] = t;
+	}
+
+	sorting = proc;
+	qsort(order, count, sizeof(*order), bystart);
+
+	for (size_t i = 0; i < count; i++) {
+		struct temp *const cur = &proc->temps.data[order[i]];
+		size_t expired = 0;
+
+		while (expired < nactive && proc->temps.data[active[expired]].end < cur->start) {
+			regs &= ~(1 << proc->temps.data[active[expired]].reg);
+			expired++;
+		}
+
+		nactive -= expired;
+		memmove(active, &active[expired], nactive * sizeof(*active));
+
+		int free;
+		const size_t dying = dyingoperand(proc, active, nactive, order[i]);
+		if (dying < nactive) {
+			free = proc->temps.data[active[dying]].reg + 1;
+			regs &= ~(1 << (free - 1));
+			nactive--;
+			memmove(&active[dying], &active[dying + 1], (nactive - dying) * sizeof(*active));
+		} else {
+			free = ffs((uint16_t)~regs);
+		}
+
+		if (!free) {
+			size_t victim = nactive;
+			for (size_t j = 0; j < nactive; j++) {
+				if (cost[active[j]] < (victim == nactive ? cost[order[i]] : cost[active[victim]]))
+					victim = j;
+			}
+
+			if (victim == nactive) {
+				spill(proc, cur, &slots);
+				continue;
+			}
+
+			struct temp *const old = &proc->temps.data[active[victim]];
+			free = old->reg + 1;
+			regs &= ~(1 << old->reg);
+			spill(proc, old, &slots);
+			nactive--;
+			memmove(&active[victim], &active[victim + 1], (nactive - victim) * sizeof(*active));
+		}
+
+		// the nth register being free corresponds to shifting by n-1
+		free--;
+		regs |= (1 << free);
+		cur->reg = free;
+
+		size_t j = nactive;
+		for (; j > 0 && proc->temps.data[active[j - 1]].end > cur->end; j--)
+			active[j] = active[j - 1];
+		active[j] = order[i];
+		nactive++;
+	}
+
+	free(slots.data);
+	free(cost);
+	free(order);
+}
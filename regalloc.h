@@ -0,0 +1 @@
+void chooseregs(struct iproc *const proc);
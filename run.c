@@ -3,86 +3,282 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "array.h"
 #include "stack.h"
 #include "nooc.h"
 #include "ir.h"
 #include "util.h"
+#include "cfg.h"
+#include "run.h"
 
-struct iproc *
-findiproc(const struct toplevel *const toplevel, struct slice s)
+// locals of interpreted procedures live in their own address range, well
+// away from the text and data of the program
+#define STACK_OFFSET 0x7f0000000000
+#define MAXSTEPS (1 << 28)
+
+struct machine {
+	// pure machines refuse to do anything observable outside of the
+	// interpreter, so that they can be used to evaluate at compile time
+	bool pure;
+	const struct token *start;
+	uint64_t steps;
+	struct data stack;
+	// the only part of the data segment a pure machine may write to
+	uint64_t wstart, wend;
+};
+
+static void
+fail(const struct machine *const m, const char *const msg)
 {
-	for (size_t i = 0; i < toplevel->code.len; i++) {
-		if (slice_cmp(&toplevel->code.data[i].s, &s) == 0) {
-			return &toplevel->code.data[i];
-		}
+	if (m->start)
+		error(m->start->line, m->start->col, "cannot evaluate expression at compile time: %s", msg);
+
+	die(msg);
+}
+
+static uint64_t
+mask(const uint64_t val, const uint8_t size)
+{
+	return size >= 8 ? val : val & ((UINT64_C(1) << 8*size) - 1);
+}
+
+static char *
+translate(const struct machine *const m, const uint64_t addr, const size_t len, const bool write)
+{
+	if (addr >= DATA_OFFSET && addr - DATA_OFFSET + len <= toplevel.data.len) {
+		if (write && m->pure && (addr < m->wstart || addr + len > m->wend))
+			fail(m, "store to a global");
+
+		return &toplevel.data.data[addr - DATA_OFFSET];
 	}
 
+	if (addr >= STACK_OFFSET && addr - STACK_OFFSET + len <= m->stack.len)
+		return &m->stack.data[addr - STACK_OFFSET];
+
+	fail(m, "access to invalid address");
 	return NULL;
 }
 
-void
-runproc(struct iproc *proc)
+static void
+runsyscall(struct machine *const m, const uint64_t *const args, const size_t nargs)
 {
-	uint64_t regs[32] = { 0 };
-	uint64_t curi = 0;
-	size_t localsize = 0;
-	void *locals = NULL;
+	uint64_t sysargs[7] = { 0 };
+	assert(nargs >= 2 && nargs <= 8);
 
-	size_t tmp;
+	if (m->pure)
+		fail(m, "system call");
 
-	while (1) {
-		switch (proc->data[curi].op) {
+	// pointers into the program have to be turned into pointers into our
+	// copy of it, anything else is passed as is
+	sysargs[0] = args[0];
+	for (size_t i = 1; i < nargs - 1; i++) {
+		if ((args[i] >= DATA_OFFSET && args[i] < DATA_OFFSET + toplevel.data.len)
+				|| (args[i] >= STACK_OFFSET && args[i] < STACK_OFFSET + m->stack.len))
+			sysargs[i] = (uint64_t)translate(m, args[i], 1, false);
+		else
+			sysargs[i] = args[i];
+	}
+
+	const uint64_t ret = syscall(sysargs[0], sysargs[1], sysargs[2], sysargs[3], sysargs[4], sysargs[5], sysargs[6]);
+	memcpy(translate(m, args[nargs - 1], 8, true), &ret, 8);
+}
+
+static void
+runproc(struct machine *const m, const struct iproc *proc, const uint64_t *args, size_t nargs)
+{
+	uint64_t *vals = xcalloc(proc->temps.len ? proc->temps.len : 1, sizeof(*vals));
+	const size_t frame = m->stack.len;
+	const struct instr *ins = proc->data, *end = &proc->data[proc->len];
+	uint64_t dest, src, label, callargs[20], tailargs[20], cur = 0, prev = 0, *phivals = NULL;
+	uint8_t size;
+	size_t count;
+
+	while (ins < end) {
+		if (++m->steps > MAXSTEPS)
+			fail(m, "evaluation did not terminate");
+
+		switch (ins->op) {
 		case IR_ASSIGN:
-			tmp = proc->data[curi].val;
-			curi++;
-			switch (proc->data[curi].op) {
+			dest = ins->val;
+			size = proc->temps.data[dest].size;
+			ins++;
+			switch (ins->op) {
+			case IR_IMM:
+				vals[dest] = ins->val;
+				break;
+			case IR_IN:
+				assert(ins->val < nargs);
+				vals[dest] = args[ins->val];
+				break;
 			case IR_ALLOC:
-				localsize += proc->data[curi].val;
-				locals = xrealloc(locals, localsize);
+				// FIXME: the x64 backend hardcodes 8 bytes as well
+				vals[dest] = STACK_OFFSET + m->stack.len;
+				array_zero((&m->stack), 8 * ins->val);
 				break;
-			case IR_IMM:
-				regs[proc->temps.data[tmp].reg] = proc->data[curi].val;
+			case IR_LOAD:
+				vals[dest] = 0;
+				memcpy(&vals[dest], translate(m, vals[ins->val], size, false), size);
+				break;
+			case IR_NOT:
+				vals[dest] = mask(vals[ins->val], 1) != 1;
+				break;
+			case IR_ADD:
+				src = vals[ins->val];
+				ins++;
+				assert(ins->op == IR_EXTRA);
+				vals[dest] = src + vals[ins->val];
+				break;
+			case IR_CEQ:
+				src = vals[ins->val];
+				ins++;
+				assert(ins->op == IR_EXTRA);
+				vals[dest] = mask(src, size) == mask(vals[ins->val], size);
+				break;
+			case IR_SELECT:
+				src = vals[ins->val];
+				ins++;
+				assert(ins->op == IR_EXTRA);
+				if (mask(src, 1) == 0)
+					ins++;
+				vals[dest] = vals[ins->val];
+				if (mask(src, 1) != 0)
+					ins++;
+				break;
+			case IR_ZEXT:
+				vals[dest] = mask(vals[ins->val], proc->temps.data[ins->val].size);
+				break;
+			case IR_COPY:
+				vals[dest] = vals[ins->val];
+				break;
+			case IR_PHI: // already done on entering the block
+				ins += 2*ins->val;
 				break;
 			default:
 				die("run: runproc: IR_ASSIGN: unhandled instruction");
 			}
+			ins++;
 			break;
 		case IR_STORE:
-			size_t val = proc->data[curi].val;
-			curi++;
-			regs[proc->temps.data[proc->data[curi].val].reg] = val;
+			src = vals[ins->val];
+			ins++;
+			assert(ins->op == IR_EXTRA);
+			size = proc->temps.data[ins->val].size;
+			memcpy(translate(m, vals[ins->val], size, true), &src, size);
+			ins++;
 			break;
 		case IR_CALL:
-			// syscall
-			if (proc->data[curi].val == 1) {
-				curi++;
-				assert(proc->data[curi].op == IR_CALLARG); // FIXME: skip return value for now
-				curi++;
-				assert(proc->data[curi].op == IR_CALLARG);
-				uint64_t arg2 = regs[proc->temps.data[proc->data[curi].val].reg];
-				curi++;
-				assert(proc->data[curi].op == IR_CALLARG);
-				uint64_t arg1 = regs[proc->temps.data[proc->data[curi].val].reg];
-				syscall(arg1, arg2);
+			dest = ins->val;
+			label = ins - proc->data;
+			ins++;
+			count = 0;
+			while (ins < end && ins->op == IR_CALLARG) {
+				assert(count < 20);
+				callargs[count++] = vals[ins->val];
+				ins++;
+			}
+
+			// arguments are listed last to first
+			for (size_t i = 0; i < count / 2; i++) {
+				src = callargs[i];
+				callargs[i] = callargs[count - i - 1];
+				callargs[count - i - 1] = src;
+			}
+
+			if (slice_cmplit(&toplevel.code.data[dest].s, "syscall") == 0) {
+				runsyscall(m, callargs, count);
+			} else if (returnsafter(proc, label)) {
+				// a call right before returning carries on in this
+				// invocation, so that tail recursion doesn't use up
+				// the stack of the compiler; locals stay allocated,
+				// since the callee may put its result in one
+				memcpy(tailargs, callargs, count * sizeof(*callargs));
+				args = tailargs;
+				nargs = count;
+				proc = &toplevel.code.data[dest];
+				free(vals);
+				vals = xcalloc(proc->temps.len ? proc->temps.len : 1, sizeof(*vals));
+				ins = proc->data;
+				end = &proc->data[proc->len];
+				cur = prev = 0;
+			} else {
+				runproc(m, &toplevel.code.data[dest], callargs, count);
+			}
+			break;
+		case IR_RETURN:
+			ins = end;
+			break;
+		case IR_LABEL:
+			prev = cur;
+			cur = ins->val;
+			ins++;
+
+			// the phis at the start of a block all read their values
+			// before any of them is written
+			count = 0;
+			for (const struct instr *phi = ins; phi < end && phi->op == IR_ASSIGN && phi[1].op == IR_PHI; phi += 2 + 2*phi[1].val) {
+				phivals = xrealloc(phivals, (count + 1) * sizeof(*phivals));
+				phivals[count] = 0;
+				for (size_t j = 0; j < phi[1].val; j++) {
+					if (phi[2 + 2*j].val == prev)
+						phivals[count] = vals[phi[3 + 2*j].val];
+				}
+				count++;
+			}
+
+			for (size_t j = 0; j < count; j++) {
+				vals[ins->val] = phivals[j];
+				ins += 2 + 2*ins[1].val;
 			}
 			break;
-		case IR_LABEL: // we already know where labels are from ir gen
+		case IR_JUMP:
+			ins = &proc->data[proc->labels.data[ins->val]];
+			break;
+		case IR_CONDJUMP:
+			label = ins->val;
+			ins++;
+			assert(ins->op == IR_EXTRA);
+			if (mask(vals[ins->val], 1) == 0)
+				ins = &proc->data[proc->labels.data[label]];
+			else
+				ins++;
 			break;
 		default:
 			die("run: runproc: unhandled instruction");
 		}
-
-		curi++;
 	}
+
+	m->stack.len = frame;
+	free(phivals);
+	free(vals);
+}
+
+// Evaluate an initializer generated by geninit, storing the result directly
+// into the data of the global being initialized.
+void
+runinit(const struct iproc *const init, const struct decl *const decl, const size_t size)
+{
+	struct machine m = {
+		.pure = true,
+		.start = decl->start,
+		.wstart = decl->w.addr,
+		.wend = decl->w.addr + size,
+	};
+
+	runproc(&m, init, &decl->w.addr, 1);
+	free(m.stack.data);
 }
 
 void
 run(const struct toplevel *const toplevel)
 {
+	struct machine m = { 0 };
 	struct slice mainslice = {5, 4, "main\0" };
-	struct iproc *main = findiproc(toplevel, mainslice);
+	struct iproc *main = findiproc(toplevel, &mainslice);
 	assert(main != NULL);
-	runproc(main);
+	runproc(&m, main, NULL, 0);
+	free(m.stack.data);
 }
@@ -1 +1,2 @@
 void run(const struct toplevel *toplevel);
+void runinit(const struct iproc *const init, const struct decl *const decl, const size_t size);
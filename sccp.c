@@ -0,0 +1,392 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "sccp.h"
+
+// what is known about a temporary so far: nothing, that it is always the
+// same value, or that it isn't
+struct cell {
+	enum {
+		CELL_TOP,
+		CELL_CONST,
+		CELL_BOTTOM,
+	} state;
+	uint64_t val;
+};
+
+struct list {
+	size_t len, cap;
+	uint64_t *data;
+};
+
+struct propagation {
+	struct cell *cells;
+	const struct argval *args;
+	size_t nargs;
+	struct list *uses; // instructions using each temporary
+	uint64_t *block; // block of each instruction
+	bool *reached; // blocks
+	bool *taken; // edges, by the index of the first successor of each block
+	uint64_t *firstedge;
+	struct list flow; // edges that were just found to be executable, as
+	                  // pairs of block and successor index
+	struct list ssa; // temporaries whose cell just changed
+};
+
+static uint64_t
+mask(const uint64_t val, const uint8_t size)
+{
+	return size >= 8 ? val : val & ((UINT64_C(1) << 8*size) - 1);
+}
+
+static struct cell
+meet(const struct cell a, const struct cell b)
+{
+	if (a.state == CELL_TOP)
+		return b;
+	if (b.state == CELL_TOP)
+		return a;
+	if (a.state == CELL_CONST && b.state == CELL_CONST && a.val == b.val)
+		return a;
+
+	return (struct cell){ .state = CELL_BOTTOM };
+}
+
+static void
+settemp(struct propagation *const p, const uint64_t t, struct cell cell)
+{
+	struct cell *const old = &p->cells[t];
+	if (cell.state != CELL_CONST)
+		cell.val = 0;
+	if (old->state == cell.state && old->val == cell.val)
+		return;
+
+	// cells only ever go down, which is what makes this terminate
+	assert(old->state < cell.state);
+	*old = cell;
+	array_add((&p->ssa), t);
+}
+
+static void
+take(struct propagation *const p, const uint64_t b, const uint64_t j)
+{
+	const uint64_t e = p->firstedge[b] + j;
+	if (p->taken[e])
+		return;
+
+	p->taken[e] = true;
+	array_add((&p->flow), b);
+	array_add((&p->flow), j);
+}
+
+// whether control can go from block 'from' to block 'to'
+static bool
+edgetaken(const struct propagation *const p, const struct iproc *const proc, const uint64_t from, const uint64_t to)
+{
+	const struct bblock *const block = &proc->blocks.data[from];
+	for (size_t j = 0; j < block->succs.len; j++) {
+		if (block->succs.data[j] == to && p->taken[p->firstedge[from] + j])
+			return true;
+	}
+
+	return false;
+}
+
+// Work out what the instruction at i computes from what is known about its
+// operands, and which edges out of its block may be taken.
+static void
+visit(struct propagation *const p, const struct iproc *const proc, const size_t i)
+{
+	const struct instr *const ins = &proc->data[i];
+	const uint64_t b = p->block[i];
+	struct cell cell = { .state = CELL_BOTTOM }, a, c;
+	uint8_t size;
+
+	switch (ins->op) {
+	case IR_JUMP:
+		take(p, b, 0);
+		return;
+	case IR_CONDJUMP:
+		c = p->cells[ins[1].val];
+		if (c.state == CELL_TOP)
+			return;
+		// the fallthrough edge comes first, and is taken when the
+		// condition holds
+		if (c.state == CELL_BOTTOM || mask(c.val, 1) != 0)
+			take(p, b, 0);
+		if (c.state == CELL_BOTTOM || mask(c.val, 1) == 0)
+			take(p, b, 1);
+		return;
+	case IR_ASSIGN:
+		break;
+	default:
+		return;
+	}
+
+	size = proc->temps.data[ins->val].size;
+	switch (ins[1].op) {
+	case IR_IMM:
+		cell = (struct cell){ .state = CELL_CONST, .val = ins[1].val };
+		break;
+	case IR_IN:
+		if (ins[1].val < p->nargs && p->args[ins[1].val].state == ARG_CONST)
+			cell = (struct cell){ .state = CELL_CONST, .val = p->args[ins[1].val].val };
+		break;
+	case IR_COPY:
+		cell = p->cells[ins[1].val];
+		break;
+	case IR_NOT:
+	case IR_ZEXT:
+		a = p->cells[ins[1].val];
+		cell = a;
+		if (a.state != CELL_CONST)
+			break;
+
+		if (ins[1].op == IR_NOT)
+			cell.val = mask(a.val, 1) != 1;
+		else
+			cell.val = mask(a.val, proc->temps.data[ins[1].val].size);
+		break;
+	case IR_ADD:
+	case IR_CEQ:
+		a = p->cells[ins[1].val];
+		c = p->cells[ins[2].val];
+		if (a.state == CELL_BOTTOM || c.state == CELL_BOTTOM) {
+			cell.state = CELL_BOTTOM;
+		} else if (a.state == CELL_TOP || c.state == CELL_TOP) {
+			cell.state = CELL_TOP;
+		} else {
+			cell.state = CELL_CONST;
+			if (ins[1].op == IR_ADD)
+				cell.val = a.val + c.val;
+			else
+				cell.val = mask(a.val, size) == mask(c.val, size);
+		}
+		break;
+	case IR_SELECT:
+		// with the condition unknown, it can only be one value if both
+		// are the same
+		c = p->cells[ins[1].val];
+		if (c.state == CELL_TOP)
+			cell.state = CELL_TOP;
+		else if (c.state == CELL_CONST)
+			cell = p->cells[ins[mask(c.val, 1) != 0 ? 2 : 3].val];
+		else
+			cell = meet(p->cells[ins[2].val], p->cells[ins[3].val]);
+		break;
+	case IR_PHI:
+		cell.state = CELL_TOP;
+		for (size_t j = 0; j < ins[1].val; j++) {
+			const uint64_t from = labelblock(proc, ins[2 + 2*j].val);
+			if (edgetaken(p, proc, from, b))
+				cell = meet(cell, p->cells[ins[3 + 2*j].val]);
+		}
+		break;
+	default:
+		break;
+	}
+
+	settemp(p, ins->val, cell);
+}
+
+static void
+visitblock(struct propagation *const p, const struct iproc *const proc, const uint64_t b)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	uint64_t last = block->start;
+
+	for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+		visit(p, proc, i);
+		last = i;
+	}
+
+	// a block without a terminator at the end falls through
+	const int op = proc->data[last].op;
+	if (op != IR_JUMP && op != IR_CONDJUMP && op != IR_RETURN && block->succs.len)
+		take(p, b, 0);
+}
+
+// Replace every temporary that turned out to be constant with an immediate,
+// and branches that always go the same way with a jump or nothing at all.
+static void
+rewrite(const struct propagation *const p, struct iproc *const proc)
+{
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		if (!p->reached[b])
+			continue;
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			struct instr *const ins = &proc->data[i];
+			const size_t len = inslen(proc, i);
+
+			if (ins->op == IR_CONDJUMP) {
+				const struct cell c = p->cells[ins[1].val];
+				if (c.state != CELL_CONST)
+					continue;
+
+				if (mask(c.val, 1) == 0) {
+					ins->op = IR_JUMP;
+					ins[1] = (struct instr){ .op = IR_NONE, .val = 1, .valtype = VT_EMPTY };
+				} else {
+					inskill(proc, i);
+				}
+				continue;
+			}
+
+			// a phi has to stay with the others at the start of its
+			// block, so a constant one is left for dce once whatever
+			// uses it is constant too
+			if (ins->op != IR_ASSIGN || ins[1].op == IR_IMM || ins[1].op == IR_PHI)
+				continue;
+
+			const struct cell c = p->cells[ins->val];
+			if (c.state != CELL_CONST)
+				continue;
+
+			ins[1] = (struct instr){ .op = IR_IMM, .val = c.val, .valtype = VT_IMM };
+			if (len > 2)
+				ins[2] = (struct instr){ .op = IR_NONE, .val = len - 2, .valtype = VT_EMPTY };
+		}
+	}
+}
+
+// Sparse conditional constant propagation, after Wegman and Zadeck: values
+// are only propagated along edges that can be taken given what is known so
+// far, so constants can flow through branches that always go the same way.
+// 'args' says which arguments are the same at every call, if anything.
+void
+sccp(struct iproc *const proc, const struct argval *const args, const size_t nargs)
+{
+	bool recursive = false;
+
+	// a procedure calling itself passes arguments of its own, which
+	// callargs only sees once it is too late
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_CALL && &toplevel.code.data[proc->data[i].val] == proc)
+			recursive = true;
+	}
+
+	struct propagation p = {
+		.cells = xcalloc(proc->temps.len, sizeof(*p.cells)),
+		.args = args,
+		.nargs = recursive ? 0 : nargs,
+		.uses = xcalloc(proc->temps.len, sizeof(*p.uses)),
+		.block = xmalloc(proc->len * sizeof(*p.block)),
+		.reached = xcalloc(proc->blocks.len, sizeof(*p.reached)),
+		.firstedge = xmalloc((proc->blocks.len + 1) * sizeof(*p.firstedge)),
+	};
+
+	p.firstedge[0] = 0;
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		p.firstedge[b + 1] = p.firstedge[b] + block->succs.len;
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const size_t len = inslen(proc, i);
+			p.block[i] = b;
+			for (size_t j = i; j < i + len; j++) {
+				const struct instr *const ins = &proc->data[j];
+				if (ins->valtype == VT_TEMP && ins->op != IR_ASSIGN)
+					array_add((&p.uses[ins->val]), i);
+			}
+		}
+	}
+	p.taken = xcalloc(p.firstedge[proc->blocks.len] + 1, sizeof(*p.taken));
+
+	p.reached[0] = true;
+	visitblock(&p, proc, 0);
+
+	while (p.flow.len || p.ssa.len) {
+		while (p.flow.len) {
+			const uint64_t j = p.flow.data[--p.flow.len];
+			const uint64_t from = p.flow.data[--p.flow.len];
+			const uint64_t to = proc->blocks.data[from].succs.data[j];
+			if (!p.reached[to]) {
+				p.reached[to] = true;
+				visitblock(&p, proc, to);
+				continue;
+			}
+
+			// only the phis can change by taking another edge in
+			const struct bblock *const block = &proc->blocks.data[to];
+			for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+				if (proc->data[i].op == IR_ASSIGN && proc->data[i + 1].op == IR_PHI)
+					visit(&p, proc, i);
+			}
+		}
+
+		while (p.ssa.len) {
+			const struct list *const uses = &p.uses[p.ssa.data[--p.ssa.len]];
+			for (size_t j = 0; j < uses->len; j++) {
+				if (p.reached[p.block[uses->data[j]]])
+					visit(&p, proc, uses->data[j]);
+			}
+		}
+	}
+
+	rewrite(&p, proc);
+
+	for (size_t t = 0; t < proc->temps.len; t++)
+		free(p.uses[t].data);
+	free(p.uses);
+	free(p.flow.data);
+	free(p.ssa.data);
+	free(p.taken);
+	free(p.firstedge);
+	free(p.reached);
+	free(p.block);
+	free(p.cells);
+
+	buildcfg(proc);
+}
+
+// Work out which arguments are the same constant at every call in proc,
+// meeting them with what its other callers pass.
+void
+callargs(const struct iproc *const proc)
+{
+	uint64_t *const def = xmalloc(proc->temps.len * sizeof(*def));
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_ASSIGN)
+			def[proc->data[i].val] = i;
+	}
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		const struct instr *const ins = &proc->data[i];
+		if (ins->op != IR_CALL)
+			continue;
+
+		struct iproc *const callee = &toplevel.code.data[ins->val];
+		const size_t count = inslen(proc, i) - 1;
+		while (callee->args.len < count) {
+			const struct argval unseen = { .state = ARG_UNSEEN };
+			array_add((&callee->args), unseen);
+		}
+
+		// arguments are listed last to first
+		for (size_t k = 1; k <= count; k++) {
+			struct argval *const arg = &callee->args.data[count - k];
+			const struct instr *const d = &proc->data[def[ins[k].val]];
+			if (d[1].op != IR_IMM) {
+				arg->state = ARG_VARIES;
+			} else if (arg->state == ARG_UNSEEN) {
+				*arg = (struct argval){ .state = ARG_CONST, .val = d[1].val };
+			} else if (arg->state == ARG_CONST && arg->val != d[1].val) {
+				arg->state = ARG_VARIES;
+			}
+		}
+	}
+
+	free(def);
+}
@@ -0,0 +1,2 @@
+void sccp(struct iproc *const proc, const struct argval *const args, const size_t nargs);
+void callargs(const struct iproc *const proc);
@@ -0,0 +1,378 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "dce.h"
+#include "simplify.h"
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+static void
+replace(struct iproc *const proc, const struct code *const code)
+{
+	free(proc->data);
+	proc->data = code->data;
+	proc->len = code->len;
+	proc->cap = code->cap;
+	buildcfg(proc);
+}
+
+static bool
+isphi(const struct iproc *const proc, const size_t i)
+{
+	return proc->data[i].op == IR_ASSIGN && proc->data[i + 1].op == IR_PHI;
+}
+
+static bool
+endsblock(const int op)
+{
+	return op == IR_JUMP || op == IR_RETURN;
+}
+
+static bool
+issucc(const struct iproc *const proc, const uint64_t b, const uint64_t s)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	for (size_t j = 0; j < block->succs.len; j++) {
+		if (block->succs.data[j] == s)
+			return true;
+	}
+
+	return false;
+}
+
+// Whether block b does nothing but go to another block, whose label goes in
+// 'to': either it is empty and falls through, or it is a single jump.
+static bool
+forwards(const struct iproc *const proc, const uint64_t b, uint64_t *const to)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	const size_t i = block->start + 1;
+
+	if (b == 0)
+		return false;
+
+	if (i == block->end) {
+		if (b + 1 == proc->blocks.len)
+			return false;
+		*to = proc->blocks.data[b + 1].label;
+		return true;
+	}
+
+	if (proc->data[i].op != IR_JUMP || i + 1 != block->end)
+		return false;
+
+	*to = proc->data[i].val;
+	return *to != block->label;
+}
+
+static bool
+onlyreturns(const struct iproc *const proc, const uint64_t b)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	return block->start + 2 == block->end && proc->data[block->start + 1].op == IR_RETURN;
+}
+
+// The value the phi at i gets from the block labelled 'label'.
+static uint64_t
+phivalue(const struct iproc *const proc, const size_t i, const uint64_t label)
+{
+	const struct instr *const ins = &proc->data[i];
+	for (size_t j = 0; j < ins[1].val; j++) {
+		if (ins[2 + 2*j].val == label)
+			return ins[3 + 2*j].val;
+	}
+
+	assert(false);
+	return 0;
+}
+
+// Make jumps to blocks that only jump on go straight to where they end up,
+// and jumps to blocks that only return return themselves. The phis of the
+// new target get the value they got through the last block skipped.
+static bool
+thread(struct iproc *const proc)
+{
+	uint64_t *const target = xmalloc(proc->blocks.len * sizeof(*target));
+	uint64_t *const through = xmalloc(proc->blocks.len * sizeof(*through));
+	bool *const returns = xcalloc(proc->blocks.len, sizeof(*returns));
+	bool changed = false;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct instr *const ins = &proc->data[blocklast(proc, b)];
+		target[b] = through[b] = NOBLOCK;
+		if (proc->blocks.data[b].rpo == NOBLOCK || (ins->op != IR_JUMP && ins->op != IR_CONDJUMP))
+			continue;
+
+		uint64_t s = labelblock(proc, ins->val), via = NOBLOCK, to;
+		for (size_t hops = 0; hops < proc->blocks.len && forwards(proc, s, &to); hops++) {
+			via = s;
+			s = labelblock(proc, to);
+		}
+
+		if (ins->op == IR_JUMP && onlyreturns(proc, s)) {
+			returns[b] = changed = true;
+			continue;
+		}
+
+		// two edges into the same block would need two values in its
+		// phis
+		if (via == NOBLOCK || issucc(proc, b, s))
+			continue;
+
+		target[b] = s;
+		through[b] = via;
+		changed = true;
+	}
+
+	if (changed) {
+		struct code code = { 0 };
+		for (size_t b = 0; b < proc->blocks.len; b++) {
+			const struct bblock *const block = &proc->blocks.data[b];
+			const uint64_t last = blocklast(proc, b);
+
+			for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+				const struct instr *const ins = &proc->data[i];
+
+				if (i == last && returns[b]) {
+					put(&code, IR_RETURN, 0, VT_EMPTY);
+					continue;
+				}
+
+				if (!isphi(proc, i)) {
+					const size_t at = code.len;
+					array_push((&code), ins, inslen(proc, i));
+					if (i == last && target[b] != NOBLOCK)
+						code.data[at].val = proc->blocks.data[target[b]].label;
+					continue;
+				}
+
+				size_t extra = 0;
+				for (size_t p = 0; p < proc->blocks.len; p++)
+					extra += target[p] == b;
+
+				array_push((&code), ins, 1);
+				put(&code, IR_PHI, ins[1].val + extra, VT_IMM);
+				array_push((&code), &ins[2], 2*ins[1].val);
+				for (size_t p = 0; p < proc->blocks.len; p++) {
+					if (target[p] != b)
+						continue;
+					put(&code, IR_EXTRA, proc->blocks.data[p].label, VT_LABEL);
+					put(&code, IR_EXTRA, phivalue(proc, i, proc->blocks.data[through[p]].label), VT_TEMP);
+				}
+			}
+		}
+		replace(proc, &code);
+	}
+
+	free(returns);
+	free(through);
+	free(target);
+	return changed;
+}
+
+// A branch on a condition already tested by a dominating branch goes the
+// same way as the edge out of that one it is under.
+static bool
+known(struct iproc *const proc)
+{
+	bool changed = false;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const uint64_t last = blocklast(proc, b);
+		struct instr *const ins = &proc->data[last];
+		if (proc->blocks.data[b].rpo == NOBLOCK || ins->op != IR_CONDJUMP)
+			continue;
+
+		for (uint64_t d = b; d != 0;) {
+			const uint64_t a = proc->blocks.data[d].idom;
+			const struct bblock *const above = &proc->blocks.data[a];
+			const struct instr *const test = &proc->data[blocklast(proc, a)];
+
+			if (test->op == IR_CONDJUMP && test[1].val == ins[1].val && above->succs.len == 2 && above->succs.data[0] != above->succs.data[1] && proc->blocks.data[d].preds.len == 1 && issucc(proc, a, d)) {
+				// the fallthrough edge is taken when the condition
+				// holds
+				if (d == above->succs.data[0]) {
+					inskill(proc, last);
+				} else {
+					ins->op = IR_JUMP;
+					ins[1] = (struct instr){ .op = IR_NONE, .val = 1, .valtype = VT_EMPTY };
+				}
+				changed = true;
+				break;
+			}
+			d = a;
+		}
+	}
+
+	if (changed)
+		buildcfg(proc);
+	return changed;
+}
+
+// Append each block that is the only successor of its only predecessor to
+// that predecessor, so that there is no jump between them.
+static bool
+merge(struct iproc *const proc)
+{
+	uint64_t *const next = xmalloc(proc->blocks.len * sizeof(*next));
+	bool *const absorbed = xcalloc(proc->blocks.len, sizeof(*absorbed));
+	bool any = false;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		next[b] = NOBLOCK;
+		if (block->rpo == NOBLOCK || block->succs.len != 1 || proc->data[blocklast(proc, b)].op == IR_CONDJUMP)
+			continue;
+
+		const uint64_t s = block->succs.data[0];
+		if (s == b || s == 0 || proc->blocks.data[s].preds.len != 1)
+			continue;
+
+		next[b] = s;
+		absorbed[s] = any = true;
+	}
+
+	if (any) {
+		const size_t nlabels = proc->labels.len;
+		uint64_t *const relabel = xmalloc(nlabels * sizeof(*relabel));
+		// the blocks put in to jump to each block after a branch that
+		// used to fall into it, and what that branch was in
+		uint64_t *const edge = xcalloc(nlabels, sizeof(*edge));
+		uint64_t *const edgefrom = xcalloc(nlabels, sizeof(*edgefrom));
+		struct code code = { 0 };
+
+		for (size_t l = 0; l < nlabels; l++)
+			relabel[l] = l;
+
+		for (size_t b = 0; b < proc->blocks.len; b++) {
+			if (absorbed[b])
+				continue;
+
+			const uint64_t head = proc->blocks.data[b].label;
+			for (uint64_t c = b; c != NOBLOCK; c = next[c]) {
+				const struct bblock *const block = &proc->blocks.data[c];
+				const uint64_t last = blocklast(proc, c);
+				if (c != b)
+					relabel[block->label] = head;
+
+				for (size_t i = c == b ? block->start : block->start + 1; i < block->end; i += inslen(proc, i)) {
+					const struct instr *const ins = &proc->data[i];
+					if (i == last && ins->op == IR_JUMP && next[c] != NOBLOCK)
+						continue;
+
+					// with a single predecessor, a phi is just a copy
+					if (c != b && isphi(proc, i)) {
+						const uint64_t pred = proc->blocks.data[block->preds.data[0]].label;
+						put(&code, IR_ASSIGN, ins->val, VT_TEMP);
+						put(&code, IR_COPY, phivalue(proc, i, pred), VT_TEMP);
+						continue;
+					}
+
+					array_push((&code), ins, inslen(proc, i));
+				}
+
+				// a block moved away from what came after it has to
+				// jump there now, from a block of its own if it ends
+				// with a branch
+				const int op = proc->data[last].op;
+				if (c == b || next[c] != NOBLOCK || endsblock(op) || c + 1 == proc->blocks.len)
+					continue;
+
+				const uint64_t to = proc->blocks.data[c + 1].label;
+				if (op == IR_CONDJUMP) {
+					edge[to] = newlabel(proc);
+					edgefrom[to] = block->label;
+					put(&code, IR_LABEL, edge[to], VT_LABEL);
+				}
+				put(&code, IR_JUMP, to, VT_LABEL);
+			}
+		}
+
+		uint64_t cur = 0;
+		for (size_t i = 0; i < code.len; i++) {
+			struct instr *const ins = &code.data[i];
+			if (ins->op == IR_LABEL)
+				cur = ins->val;
+			if (ins->op != IR_ASSIGN || ins[1].op != IR_PHI)
+				continue;
+
+			for (size_t j = 0; j < ins[1].val; j++) {
+				struct instr *const from = &ins[2 + 2*j];
+				if (cur < nlabels && edge[cur] && from->val == edgefrom[cur])
+					from->val = edge[cur];
+				else
+					from->val = relabel[from->val];
+			}
+			i += 1 + 2*ins[1].val;
+		}
+
+		free(edgefrom);
+		free(edge);
+		free(relabel);
+		replace(proc, &code);
+	}
+
+	free(absorbed);
+	free(next);
+	return any;
+}
+
+// Drop jumps to the block right after, which is where control goes anyway.
+static bool
+fallthrough(struct iproc *const proc)
+{
+	bool changed = false;
+
+	for (size_t b = 0; b + 1 < proc->blocks.len; b++) {
+		const uint64_t last = blocklast(proc, b);
+		const struct instr *const ins = &proc->data[last];
+		if ((ins->op == IR_JUMP || ins->op == IR_CONDJUMP) && ins->val == proc->blocks.data[b + 1].label) {
+			inskill(proc, last);
+			changed = true;
+		}
+	}
+
+	if (changed)
+		buildcfg(proc);
+	return changed;
+}
+
+// Clean up the control flow left by building the IR and by the other
+// passes: branches whose outcome is known go one way, jumps to jumps go
+// straight to the end, blocks only ever entered from one other block are
+// merged into it, and jumps to the next block are dropped.
+void
+simplifycfg(struct iproc *const proc)
+{
+	bool changed = true;
+
+	while (changed) {
+		changed = known(proc);
+		changed |= thread(proc);
+		// what can't be reached anymore, and values phis got along
+		// edges that are gone
+		if (changed)
+			dce(proc);
+		changed |= merge(proc);
+		changed |= fallthrough(proc);
+	}
+}
@@ -0,0 +1 @@
+void simplifycfg(struct iproc *const proc);
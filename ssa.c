@@ -0,0 +1,231 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "nooc.h"
+#include "stack.h"
+#include "ir.h"
+#include "util.h"
+#include "cfg.h"
+#include "ssa.h"
+
+#define NOPOS UINT64_MAX
+
+struct code {
+	size_t len, cap;
+	struct instr *data;
+};
+
+static void
+put(struct code *const code, const int op, const uint64_t val, const int valtype)
+{
+	const struct instr ins = { .val = val, .op = op, .valtype = valtype };
+	array_add(code, ins);
+}
+
+// the incoming value of the phi at i along the edge from the block labeled
+// 'label'
+static uint64_t
+phiarg(const struct iproc *const proc, const size_t i, const uint64_t label)
+{
+	const struct instr *const phi = &proc->data[i + 1];
+	for (size_t j = 0; j < phi->val; j++) {
+		if (phi[1 + 2*j].val == label)
+			return phi[2 + 2*j].val;
+	}
+
+	die("ssa: phi has no value for predecessor");
+	return 0;
+}
+
+static bool
+isphi(const struct iproc *const proc, const size_t i)
+{
+	return proc->data[i].op == IR_ASSIGN && proc->data[i + 1].op == IR_PHI;
+}
+
+// Check that every temporary is defined exactly once and that its
+// definition dominates all of its uses.
+void
+ssacheck(const struct iproc *const proc)
+{
+	uint64_t *const def = xmalloc(proc->temps.len * sizeof(*def));
+	uint64_t *const defblock = xmalloc(proc->temps.len * sizeof(*defblock));
+
+	for (size_t t = 0; t < proc->temps.len; t++)
+		def[t] = NOPOS;
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			if (proc->data[i].op != IR_ASSIGN)
+				continue;
+
+			if (def[proc->data[i].val] != NOPOS)
+				die("ssacheck: temporary defined more than once");
+
+			def[proc->data[i].val] = i;
+			defblock[proc->data[i].val] = b;
+		}
+	}
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		bool phis = true;
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			const size_t len = inslen(proc, i);
+			if (proc->data[i].op == IR_LABEL)
+				continue;
+
+			if (!isphi(proc, i)) {
+				phis = false;
+				for (size_t j = i; j < i + len; j++) {
+					const struct instr *const ins = &proc->data[j];
+					if (ins->valtype != VT_TEMP || ins->op == IR_ASSIGN)
+						continue;
+
+					if (def[ins->val] == NOPOS)
+						die("ssacheck: use of undefined temporary");
+
+					if (defblock[ins->val] == b ? def[ins->val] >= i : !dominates(proc, defblock[ins->val], b))
+						die("ssacheck: definition does not dominate use");
+				}
+				continue;
+			}
+
+			if (!phis)
+				die("ssacheck: phi after the start of a block");
+
+			const struct instr *const phi = &proc->data[i + 1];
+			if (phi->val != block->preds.len)
+				die("ssacheck: phi does not have a value for each predecessor");
+
+			for (size_t j = 0; j < phi->val; j++) {
+				const uint64_t pred = labelblock(proc, phi[1 + 2*j].val);
+				const uint64_t val = phi[2 + 2*j].val;
+				if (def[val] == NOPOS)
+					die("ssacheck: use of undefined temporary");
+
+				// the value has to be available at the end of the predecessor
+				if (!dominates(proc, defblock[val], pred))
+					die("ssacheck: definition does not dominate use");
+			}
+		}
+	}
+
+	free(def);
+	free(defblock);
+}
+
+// copies feeding the phis of block s along the edge from the block labeled
+// 'label'
+static void
+putphicopies(struct code *const code, const struct iproc *const proc, const uint64_t s, const uint64_t label, const uint64_t *const fresh)
+{
+	const struct bblock *const succ = &proc->blocks.data[s];
+	for (size_t i = succ->start; i < succ->end; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_LABEL)
+			continue;
+		if (!isphi(proc, i))
+			break;
+
+		put(code, IR_ASSIGN, fresh[proc->data[i].val], VT_TEMP);
+		put(code, IR_COPY, phiarg(proc, i, label), VT_TEMP);
+	}
+}
+
+static bool
+hasphis(const struct iproc *const proc, const uint64_t b)
+{
+	const struct bblock *const block = &proc->blocks.data[b];
+	const size_t i = block->start + inslen(proc, block->start);
+	return i < block->end && isphi(proc, i);
+}
+
+// Take the procedure out of SSA form by replacing each phi with copies at
+// the end of its predecessors. Every phi gets a fresh temporary that all of
+// them copy into, so that the phis of a block still happen at once. Edges
+// from blocks with multiple successors are split first, so that the copies
+// only happen along the edge they belong to.
+void
+ssadestruct(struct iproc *const proc)
+{
+	struct code code = { 0 }, tail = { 0 };
+	const size_t ntemps = proc->temps.len;
+	uint64_t *const fresh = xcalloc(ntemps, sizeof(*fresh));
+	bool any = false;
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (!isphi(proc, i))
+			continue;
+
+		const struct temp *const temp = &proc->temps.data[proc->data[i].val];
+		fresh[proc->data[i].val] = newtemp(proc, temp->size, temp->flags);
+		any = true;
+	}
+
+	if (!any) {
+		free(fresh);
+		return;
+	}
+
+	for (size_t b = 0; b < proc->blocks.len; b++) {
+		const struct bblock *const block = &proc->blocks.data[b];
+		const uint64_t last = blocklast(proc, b);
+		const int lastop = proc->data[last].op;
+
+		for (size_t i = block->start; i < block->end; i += inslen(proc, i)) {
+			if (i == last && lastop == IR_JUMP) {
+				const uint64_t s = labelblock(proc, proc->data[i].val);
+				putphicopies(&code, proc, s, block->label, fresh);
+			}
+
+			if (i == last && lastop == IR_CONDJUMP && hasphis(proc, labelblock(proc, proc->data[i].val))) {
+				// taken edge: jump to a new block at the end instead
+				const uint64_t s = labelblock(proc, proc->data[i].val);
+				const uint64_t l = newlabel(proc);
+				put(&tail, IR_LABEL, l, VT_LABEL);
+				putphicopies(&tail, proc, s, block->label, fresh);
+				put(&tail, IR_JUMP, proc->blocks.data[s].label, VT_LABEL);
+
+				put(&code, IR_CONDJUMP, l, VT_LABEL);
+				array_push((&code), &proc->data[i + 1], 1);
+				continue;
+			}
+
+			if (isphi(proc, i)) {
+				put(&code, IR_ASSIGN, proc->data[i].val, VT_TEMP);
+				put(&code, IR_COPY, fresh[proc->data[i].val], VT_TEMP);
+				continue;
+			}
+
+			array_push((&code), &proc->data[i], inslen(proc, i));
+		}
+
+		if (lastop == IR_RETURN || lastop == IR_JUMP || b + 1 == proc->blocks.len)
+			continue;
+
+		if (hasphis(proc, b + 1)) {
+			// fallthrough edge: if it is critical, put a new block in
+			// between
+			if (lastop == IR_CONDJUMP)
+				put(&code, IR_LABEL, newlabel(proc), VT_LABEL);
+			putphicopies(&code, proc, b + 1, block->label, fresh);
+		}
+	}
+
+	if (tail.len)
+		array_push((&code), tail.data, tail.len);
+	free(tail.data);
+	free(fresh);
+
+	free(proc->data);
+	proc->data = code.data;
+	proc->len = code.len;
+	proc->cap = code.cap;
+
+	buildcfg(proc);
+}
@@ -0,0 +1,2 @@
+void ssacheck(const struct iproc *const proc);
+void ssadestruct(struct iproc *const proc);
@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "nooc.h"
 #include "stack.h"
@@ -17,7 +20,10 @@
 
 struct types types;
 
-static const struct stack *blocks;
+struct typechecker {
+	struct stack blocks;
+	struct diags diags;
+};
 
 static struct typetable {
 	size_t cap, count;
@@ -164,8 +170,8 @@ type_put(const struct type *const type)
 	return table.vals[i];
 }
 
-void
-typecompat(const size_t typei, const size_t expri)
+static void
+typecompat(struct typechecker *const tc, const size_t typei, const size_t expri)
 {
 	const struct type *const type = &types.data[typei];
 	const struct expr *const expr = &exprs.data[expri];
@@ -173,30 +179,34 @@ typecompat(const size_t typei, const size_t expri)
 	switch (type->class) {
 	case TYPE_INT:
 		if (expr->class != C_INT)
-			error(expr->start->line, expr->start->col, "expected integer expression for integer declaration");
+			diag(&tc->diags, expr->start->line, expr->start->col, "expected integer expression for integer declaration");
 		break;
 	case TYPE_ARRAY:
 		if (expr->class != C_STR)
-			error(expr->start->line, expr->start->col, "expected string expression for array declaration");
+			diag(&tc->diags, expr->start->line, expr->start->col, "expected string expression for array declaration");
 		break;
 	case TYPE_REF:
 		if (expr->class != C_REF)
-			error(expr->start->line, expr->start->col, "expected reference expression for reference declaration");
+			diag(&tc->diags, expr->start->line, expr->start->col, "expected reference expression for reference declaration");
 		break;
 	case TYPE_PROC:
-		if (expr->class != C_PROC)
-			error(expr->start->line, expr->start->col, "expected proc expression for proc declaration");
+		if (expr->class != C_PROC) {
+			diag(&tc->diags, expr->start->line, expr->start->col, "expected proc expression for proc declaration");
+			break;
+		}
 
-		if (expr->d.proc.in.len != type->d.params.in.len)
-			error(expr->start->line, expr->start->col, "procedure expression takes %u parameters, but declaration has type which takes %u", expr->d.proc.in.len, type->d.params.in.len);
+		if (expr->d.proc.in.len != type->d.params.in.len) {
+			diag(&tc->diags, expr->start->line, expr->start->col, "procedure expression takes %u parameters, but declaration has type which takes %u", expr->d.proc.in.len, type->d.params.in.len);
+			break;
+		}
 
 		for (size_t j = 0; j < expr->d.proc.in.len; j++) {
 			if (expr->d.proc.in.data[j].type != type->d.params.in.data[j])
-				error(expr->start->line, expr->start->col, "unexpected type for parameter %u in procedure declaration", j);
+				diag(&tc->diags, expr->start->line, expr->start->col, "unexpected type for parameter %u in procedure declaration", j);
 		}
 		break;
 	default:
-		error(expr->start->line, expr->start->col, "unknown decl type");
+		diag(&tc->diags, expr->start->line, expr->start->col, "unknown decl type");
 	}
 }
 
@@ -213,16 +223,15 @@ typeref(const size_t typei)
 }
 
 static void
-typecheckcall(const struct expr *const expr)
+typecheckcall(struct typechecker *const tc, const struct expr *const expr)
 {
 	assert(expr->kind == EXPR_FCALL);
-	const struct decl *const decl = finddecl(blocks, expr->d.call.name);
+	const struct decl *const decl = finddecl(&tc->blocks, expr->d.call.name);
 
 	if (decl == NULL) {
-		if (slice_cmplit(&expr->d.call.name, "syscall") == 0)
-			return;
-		else
-			error(expr->start->line, expr->start->col, "unknown function '%.*s'", expr->d.call.name.len, expr->d.call.name.data);
+		if (slice_cmplit(&expr->d.call.name, "syscall") != 0)
+			diag(&tc->diags, expr->start->line, expr->start->col, "unknown function '%.*s'", expr->d.call.name.len, expr->d.call.name.data);
+		return;
 	}
 
 	const struct type *const type = &types.data[decl->type];
@@ -231,23 +240,23 @@ typecheckcall(const struct expr *const expr)
 	// should this throw an error instead and we move the check out of parsing?
 	assert(expr->d.call.params.len == type->d.params.in.len);
 	for (int i = 0; i < type->d.params.in.len; i++)
-		typecompat(type->d.params.in.data[i], expr->d.call.params.data[i]);
+		typecompat(tc, type->d.params.in.data[i], expr->d.call.params.data[i]);
 }
 
 static void
-typecheckexpr(const size_t expri)
+typecheckexpr(struct typechecker *const tc, const size_t expri)
 {
 	const struct expr *const expr = &exprs.data[expri];
 	switch (expr->kind) {
 	case EXPR_BINARY:
-		typecheckexpr(expr->d.bop.left);
-		typecheckexpr(expr->d.bop.right);
+		typecheckexpr(tc, expr->d.bop.left);
+		typecheckexpr(tc, expr->d.bop.right);
 		break;
 	case EXPR_UNARY:
-		typecheckexpr(expr->d.bop.left);
+		typecheckexpr(tc, expr->d.bop.left);
 		break;
 	case EXPR_COND:
-		typecheckexpr(expr->d.cond.cond);
+		typecheckexpr(tc, expr->d.cond.cond);
 		break;
 	case EXPR_LIT:
 	case EXPR_PROC:
@@ -256,17 +265,16 @@ typecheckexpr(const size_t expri)
 	case EXPR_ACCESS:
 		break;
 	case EXPR_FCALL:
-		typecheckcall(expr);
+		typecheckcall(tc, expr);
 		break;
 	default:
 		die("typecheckexpr: bad expr kind");
 	}
 }
 
-void
-typecheck(const struct stack *const blockstack, const struct block *const block)
+static void
+typecheckblock(struct typechecker *const tc, const struct block *const block)
 {
-	blocks = blockstack;
 	for (size_t i = 0; i < block->len; i++) {
 		const struct statement *const statement = &block->data[i];
 		const struct decl *decl;
@@ -274,30 +282,122 @@ typecheck(const struct stack *const blockstack, const struct block *const block)
 		switch (block->data[i].kind) {
 		case STMT_ASSGN:
 			assgn = &assgns.data[statement->idx];
-			decl = finddecl(blocks, assgn->s);
-			if (decl == NULL)
-				error(assgn->start->line, assgn->start->col, "typecheck: unknown name '%.*s'", assgn->s.len, assgn->s.data);
+			decl = finddecl(&tc->blocks, assgn->s);
+			if (decl == NULL) {
+				diag(&tc->diags, assgn->start->line, assgn->start->col, "typecheck: unknown name '%.*s'", assgn->s.len, assgn->s.data);
+				break;
+			}
 
-			typecheckexpr(assgn->val);
+			typecheckexpr(tc, assgn->val);
 			if (decl->out) {
 				const struct type *const type = &types.data[decl->type];
-				typecompat(type->d.subtype, assgn->val);
+				typecompat(tc, type->d.subtype, assgn->val);
 			} else {
-				typecompat(decl->type, assgn->val);
+				typecompat(tc, decl->type, assgn->val);
 			}
 			break;
 		case STMT_DECL:
 			decl = &block->decls.data[statement->idx];
-			typecheckexpr(decl->val);
-			typecompat(decl->type, decl->val);
+			typecheckexpr(tc, decl->val);
+			typecompat(tc, decl->type, decl->val);
 			break;
 		case STMT_EXPR:
 		case STMT_RETURN:
 			break;
 		default:
-			error(statement->start->line, statement->start->col, "unknown statement type");
+			diag(&tc->diags, statement->start->line, statement->start->col, "unknown statement type");
 		}
 	}
+}
+
+// procedure bodies only read the toplevel scope, so they are checked
+// concurrently, each with its own scope stack and diagnostics; every worker
+// takes the next unchecked one until there are none left
+struct workqueue {
+	const struct block *toplevel;
+	const struct block **procs;
+	struct typechecker *checkers;
+	size_t len;
+	atomic_size_t next;
+};
+
+static void *
+typecheckworker(void *arg)
+{
+	struct workqueue *const queue = arg;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&queue->next, 1)) < queue->len) {
+		struct typechecker *const tc = &queue->checkers[i];
+		stackpush(&tc->blocks, queue->toplevel);
+		stackpush(&tc->blocks, queue->procs[i]);
+		typecheckblock(tc, queue->procs[i]);
+		free(tc->blocks.data);
+	}
+
+	return NULL;
+}
+
+void
+typecheck(const struct block *const block)
+{
+	struct typechecker tc = { 0 };
+	struct {
+		size_t len, cap;
+		const struct block **data;
+	} procs = { 0 };
+
+	stackpush(&tc.blocks, block);
+	typecheckblock(&tc, block);
+	free(tc.blocks.data);
+
+	for (size_t i = 0; i < block->len; i++) {
+		if (block->data[i].kind != STMT_DECL)
+			continue;
+
+		const struct decl *const decl = &block->decls.data[block->data[i].idx];
+		const struct expr *const expr = &exprs.data[decl->val];
+		if (expr->kind == EXPR_PROC) {
+			const struct block *proc = &expr->d.proc.block;
+			array_add((&procs), proc);
+		}
+	}
+
+	struct workqueue queue = {
+		.toplevel = block,
+		.procs = procs.data,
+		.len = procs.len,
+		.checkers = xcalloc(procs.len ? procs.len : 1, sizeof(*queue.checkers)),
+	};
+	atomic_init(&queue.next, 0);
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = ncpu > 0 ? ncpu : 1;
+	if (nthreads > procs.len)
+		nthreads = procs.len;
+
+	pthread_t *const threads = xcalloc(nthreads ? nthreads : 1, sizeof(*threads));
+	for (size_t i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, typecheckworker, &queue))
+			die("typecheck: failed to create worker thread");
+	}
+
+	for (size_t i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	// merge in declaration order so that equal positions sort the same way every run
+	for (size_t i = 0; i < procs.len; i++) {
+		for (size_t j = 0; j < queue.checkers[i].diags.len; j++) {
+			struct diag d = queue.checkers[i].diags.data[j];
+			d.seq = tc.diags.len;
+			array_add((&tc.diags), d);
+		}
+		free(queue.checkers[i].diags.data);
+	}
+
+	free(queue.checkers);
+	free(procs.data);
 
-	blocks = NULL;
+	diagflush(&tc.diags);
 }
@@ -60,6 +60,9 @@ dumpval(const struct expr *const e)
 	case C_INT:
 		fprintf(stderr, "%ld", e->d.v.v.i64);
 		break;
+	case C_BOOL:
+		fprintf(stderr, "%s", e->d.v.v.i64 ? "true" : "false");
+		break;
 	case C_STR:
 		fprintf(stderr, "\"%.*s\"", (int)e->d.v.v.s.len, e->d.v.v.s.data);
 		break;
@@ -148,6 +151,7 @@ void
 dumpir(const struct iproc *const instrs)
 {
 	bool callarg = false;
+	uint64_t phiargs = 0;
 	char sig;
 	for (int i = 0; i < instrs->len; i++) {
 		struct instr *instr = &instrs->data[i];
@@ -182,15 +186,34 @@ dumpir(const struct iproc *const instrs)
 		case IR_CEQ:
 			fprintf(stderr, "ceq %c%lu", sig, instr->val);
 			break;
+		case IR_SELECT:
+			// the first of the two values goes on the same line too
+			fprintf(stderr, "select %c%lu, %c%lu", sig, instr->val, sigil(instr[1].valtype), instr[1].val);
+			i++;
+			break;
 		case IR_NOT:
 			fprintf(stderr, "not %c%lu\n", sig, instr->val);
 			break;
 		case IR_ZEXT:
 			fprintf(stderr, "zext %c%lu\n", sig, instr->val);
 			break;
+		case IR_PHI:
+			fputs("phi", stderr);
+			phiargs = 2*instr->val;
+			break;
+		case IR_COPY:
+			fprintf(stderr, "copy %c%lu\n", sig, instr->val);
+			break;
 		case IR_EXTRA:
+			if (phiargs) {
+				fprintf(stderr, " %c%lu%s", sig, instr->val, --phiargs ? "" : "\n");
+				break;
+			}
 			fprintf(stderr, ", %c%lu\n", sig, instr->val);
 			break;
+		case IR_NONE:
+			fputs("none\n", stderr);
+			break;
 		case IR_CALLARG:
 			fprintf(stderr, ", %c%lu", sig, instr->val);
 			break;
@@ -277,6 +300,52 @@ error(const size_t line, const size_t col, const char *error, ...)
 	exit(1);
 }
 
+void
+diag(struct diags *const diags, const size_t line, const size_t col, const char *error, ...)
+{
+	va_list args;
+	struct diag d = { .line = line, .col = col, .seq = diags->len };
+
+	va_start(args, error);
+	int len = vsnprintf(NULL, 0, error, args);
+	va_end(args);
+
+	d.msg = xmalloc(len + 1);
+	va_start(args, error);
+	vsnprintf(d.msg, len + 1, error, args);
+	va_end(args);
+
+	array_add(diags, d);
+}
+
+static int
+diagcmp(const void *a, const void *b)
+{
+	const struct diag *const d1 = a, *const d2 = b;
+	if (d1->line != d2->line)
+		return d1->line < d2->line ? -1 : 1;
+	if (d1->col != d2->col)
+		return d1->col < d2->col ? -1 : 1;
+	if (d1->seq != d2->seq)
+		return d1->seq < d2->seq ? -1 : 1;
+
+	return 0;
+}
+
+// print collected diagnostics in source order and exit if there were any
+void
+diagflush(struct diags *const diags)
+{
+	if (!diags->len)
+		return;
+
+	qsort(diags->data, diags->len, sizeof(*diags->data), diagcmp);
+	for (size_t i = 0; i < diags->len; i++)
+		fprintf(stderr, "%s:%lu:%lu: %s\n", infile, diags->data[i].line, diags->data[i].col, diags->data[i].msg);
+
+	exit(1);
+}
+
 void
 die(const char *const error)
 {
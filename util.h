@@ -7,6 +7,8 @@ struct decl *finddecl(const struct stack *const blocks, struct slice s);
 int slice_cmp(const struct slice *const s1, const struct slice *const s2);
 int slice_cmplit(const struct slice *const s1, const char *const s2);
 void error(const size_t line, const size_t col, const char *error, ...);
+void diag(struct diags *const diags, const size_t line, const size_t col, const char *error, ...);
+void diagflush(struct diags *const diags);
 void die(const char *const error);
 void *xmalloc(size_t size);
 void *xrealloc(void *, size_t);
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "nooc.h"
@@ -9,6 +10,9 @@
 #include "util.h"
 #include "array.h"
 #include "target.h"
+#include "cfg.h"
+#include "bitset.h"
+#include "live.h"
 
 enum reg {
 	RAX,
@@ -30,6 +34,7 @@ enum reg {
 };
 
 enum rex {
+	REX = 0x40,
 	REX_B = 0x41,
 	REX_X = 0x42,
 	REX_R = 0x44,
@@ -48,21 +53,40 @@ enum mod {
 char abi_arg[] = {RAX, RDI, RSI, RDX, R10, R8, R9};
 unsigned short used_reg;
 
+// without a REX prefix, byte registers 4-7 are AH, CH, DH and BH rather
+// than SPL, BPL, SIL and DIL
+static uint8_t
+rexbyte(const uint8_t opsize, const enum reg reg)
+{
+	return opsize == 1 && reg >= RSP && reg <= RDI ? REX : 0;
+}
+
+// add, sub or cmp of a 64-bit register and an immediate, which is
+// sign-extended from a byte when it fits in one
 static size_t
-add_r64_imm(struct data *const text, const enum reg dest, const uint64_t imm)
+_arith_r64_imm(struct data *const text, const uint8_t ext, const enum reg reg, const int32_t imm)
 {
 	uint8_t temp;
+	const bool small = -128 <= imm && imm <= 127;
 	if (text) {
-		array_addlit(text, REX_W);
-		array_addlit(text, 0x81);
-		array_addlit(text, (MOD_DIRECT << 6) | dest);
+		array_addlit(text, REX_W | (reg >= 8 ? REX_B : 0));
+		array_addlit(text, small ? 0x83 : 0x81);
+		array_addlit(text, (MOD_DIRECT << 6) | (ext << 3) | (reg & 7));
 		array_addlit(text, imm & 0xFF);
-		array_addlit(text, (imm >> 8) & 0xFF);
-		array_addlit(text, (imm >> 16) & 0xFF);
-		array_addlit(text, (imm >> 24) & 0xFF);
+		if (!small) {
+			array_addlit(text, (imm >> 8) & 0xFF);
+			array_addlit(text, (imm >> 16) & 0xFF);
+			array_addlit(text, (imm >> 24) & 0xFF);
+		}
 	}
 
-	return 7;
+	return small ? 4 : 7;
+}
+
+static size_t
+add_r64_imm(struct data *const text, const enum reg dest, const int32_t imm)
+{
+	return _arith_r64_imm(text, 0, dest, imm);
 }
 
 static size_t
@@ -90,6 +114,8 @@ mov_r32_imm(struct data *const text, const enum reg dest, const uint32_t imm)
 {
 	uint8_t temp;
 	if (text) {
+		if (dest >= 8)
+			array_addlit(text, REX_B);
 		array_addlit(text, 0xb8 + (dest & 0x7));
 		array_addlit(text, imm & 0xFF);
 		array_addlit(text, (imm >> 8) & 0xFF);
@@ -97,7 +123,25 @@ mov_r32_imm(struct data *const text, const enum reg dest, const uint32_t imm)
 		array_addlit(text, (imm >> 24) & 0xFF);
 	}
 
-	return 5;
+	return dest >= 8 ? 6 : 5;
+}
+
+// mov of an immediate sign-extended from 32 bits to 64
+static size_t
+mov_r64_simm32(struct data *const text, const enum reg dest, const int32_t imm)
+{
+	uint8_t temp;
+	if (text) {
+		array_addlit(text, REX_W | (dest >= 8 ? REX_B : 0));
+		array_addlit(text, 0xC7);
+		array_addlit(text, (MOD_DIRECT << 6) | (dest & 7));
+		array_addlit(text, imm & 0xFF);
+		array_addlit(text, (imm >> 8) & 0xFF);
+		array_addlit(text, (imm >> 16) & 0xFF);
+		array_addlit(text, (imm >> 24) & 0xFF);
+	}
+
+	return 7;
 }
 
 static size_t
@@ -126,126 +170,146 @@ mov_r8_imm(struct data *const text, const enum reg dest, const uint8_t imm)
 	return 2;
 }
 
+#define MOVE_FROMREG 0
+#define MOVE_TOREG 1
+
+#define NOREG -1
+
+// The ModRM byte and whatever has to follow it for an operand in memory, at
+// the address in register mem or, if that is NOREG, at the absolute address
+// addr.
 static size_t
-mov_r64_m64(struct data *const text, const enum reg dest, const uint64_t addr)
+_memoperand(struct data *const text, const uint8_t regfield, const int mem, const uint32_t addr)
 {
 	uint8_t temp;
+	if (mem == NOREG) {
+		assert(addr <= INT32_MAX);
+		if (text) {
+			array_addlit(text, (MOD_INDIRECT << 6) | ((regfield & 7) << 3) | RSP);
+			array_addlit(text, 0x25);
+			array_addlit(text, addr & 0xFF);
+			array_addlit(text, (addr >> 8) & 0xFF);
+			array_addlit(text, (addr >> 16) & 0xFF);
+			array_addlit(text, (addr >> 24) & 0xFF);
+		}
+		return 6;
+	}
+
+	// as a base, rsp and r12 need a SIB byte and rbp and r13 a displacement
+	const bool sib = (mem & 7) == RSP, disp = (mem & 7) == RBP;
 	if (text) {
-		array_addlit(text, REX_W | (dest >= 8 ? REX_R : 0));
-		array_addlit(text, 0x8b);
-		array_addlit(text, (MOD_INDIRECT << 6) | ((dest & 7) << 3) | 4);
-		array_addlit(text, 0x25);
-		array_addlit(text, addr & 0xFF);
-		array_addlit(text, (addr >> 8) & 0xFF);
-		array_addlit(text, (addr >> 16) & 0xFF);
-		array_addlit(text, (addr >> 24) & 0xFF);
+		array_addlit(text, ((disp ? MOD_DISP8 : MOD_INDIRECT) << 6) | ((regfield & 7) << 3) | (mem & 7));
+		if (sib)
+			array_addlit(text, 0x24);
+		if (disp)
+			array_addlit(text, 0);
 	}
 
-	return 8;
+	return 1 + sib + disp;
 }
 
 static size_t
-mov_r32_m32(struct data *const text, const enum reg dest, const uint32_t addr)
+_move_between_reg_and_absolute(struct data *const text, const enum reg reg, const uint32_t addr, const uint8_t opsize, const bool dir)
 {
-	uint8_t temp;
+	uint8_t temp, rex = opsize == 8 ? REX_W : 0;
+	rex |= (reg >= 8 ? REX_R : 0) | rexbyte(opsize, reg);
+
 	if (text) {
-		if (dest >= 8) array_addlit(text, REX_R);
-		array_addlit(text, 0x8b);
-		array_addlit(text, (MOD_INDIRECT << 6) | ((dest & 7) << 3) | 4);
-		array_addlit(text, 0x25);
-		array_addlit(text, addr & 0xFF);
-		array_addlit(text, (addr >> 8) & 0xFF);
-		array_addlit(text, (addr >> 16) & 0xFF);
-		array_addlit(text, (addr >> 24) & 0xFF);
+		if (opsize == 2)
+			array_addlit(text, OP_SIZE_OVERRIDE);
+
+		if (rex)
+			array_addlit(text, rex);
+
+		array_addlit(text, 0x88 + (opsize != 1) + 2*dir);
 	}
 
-	return dest >= 8 ? 8 : 7;
+	return !!rex + (opsize == 2) + 1 + _memoperand(text, reg, NOREG, addr);
 }
 
 static size_t
-mov_r16_m16(struct data *const text, const enum reg dest, const uint32_t addr)
+mov_r64_m64(struct data *const text, const enum reg dest, const uint32_t addr)
 {
-	uint8_t temp;
-	if (text) {
-		array_addlit(text, OP_SIZE_OVERRIDE);
-		if (dest >= 8) array_addlit(text, REX_R);
-		array_addlit(text, 0x8b);
-		array_addlit(text, (MOD_INDIRECT << 6) | ((dest & 7) << 3) | 4);
-		array_addlit(text, 0x25);
-		array_addlit(text, addr & 0xFF);
-		array_addlit(text, (addr >> 8) & 0xFF);
-		array_addlit(text, (addr >> 16) & 0xFF);
-		array_addlit(text, (addr >> 24) & 0xFF);
-	}
+	return _move_between_reg_and_absolute(text, dest, addr, 8, MOVE_TOREG);
+}
 
-	return dest >= 8 ? 9 : 8;
+static size_t
+mov_r32_m32(struct data *const text, const enum reg dest, const uint32_t addr)
+{
+	return _move_between_reg_and_absolute(text, dest, addr, 4, MOVE_TOREG);
+}
+
+static size_t
+mov_r16_m16(struct data *const text, const enum reg dest, const uint32_t addr)
+{
+	return _move_between_reg_and_absolute(text, dest, addr, 2, MOVE_TOREG);
 }
 
 static size_t
 mov_r8_m8(struct data *const text, const enum reg dest, const uint32_t addr)
 {
-	uint8_t temp;
-	if (text) {
-		if (dest >= 8) array_addlit(text, REX_R);
-		array_addlit(text, 0x8a);
-		array_addlit(text, (MOD_INDIRECT << 6) | ((dest & 7) << 3) | 4);
-		array_addlit(text, 0x25);
-		array_addlit(text, addr & 0xFF);
-		array_addlit(text, (addr >> 8) & 0xFF);
-		array_addlit(text, (addr >> 16) & 0xFF);
-		array_addlit(text, (addr >> 24) & 0xFF);
-	}
+	return _move_between_reg_and_absolute(text, dest, addr, 1, MOVE_TOREG);
+}
 
-	return dest >= 8 ? 8 : 7;
+static size_t
+mov_m64_r64(struct data *const text, const uint32_t addr, const enum reg src)
+{
+	return _move_between_reg_and_absolute(text, src, addr, 8, MOVE_FROMREG);
 }
 
 static size_t
-mov_m64_r64(struct data *const text, const uint64_t addr, const enum reg src)
+mov_m32_r32(struct data *const text, const uint32_t addr, const enum reg src)
 {
-	uint8_t temp;
-	if (text) {
-		array_addlit(text, REX_W);
-		array_addlit(text, 0xA3);
-		array_addlit(text, addr & 0xFF);
-		array_addlit(text, (addr >> 8) & 0xFF);
-		array_addlit(text, (addr >> 16) & 0xFF);
-		array_addlit(text, (addr >> 24) & 0xFF);
-		array_addlit(text, (addr >> 32) & 0xFF);
-		array_addlit(text, (addr >> 40) & 0xFF);
-		array_addlit(text, (addr >> 48) & 0xFF);
-		array_addlit(text, (addr >> 56) & 0xFF);
-	}
+	return _move_between_reg_and_absolute(text, src, addr, 4, MOVE_FROMREG);
+}
 
-	return 10;
+static size_t
+mov_m16_r16(struct data *const text, const uint32_t addr, const enum reg src)
+{
+	return _move_between_reg_and_absolute(text, src, addr, 2, MOVE_FROMREG);
 }
 
 static size_t
-mov_m32_r32(struct data *const text, const uint64_t addr, const enum reg src)
+mov_m8_r8(struct data *const text, const uint32_t addr, const enum reg src)
 {
-	uint8_t temp;
+	return _move_between_reg_and_absolute(text, src, addr, 1, MOVE_FROMREG);
+}
+
+// mov of an immediate to memory, which for 64 bits is sign-extended from 32
+static size_t
+_move_imm_to_mem(struct data *const text, const uint8_t opsize, const int mem, const uint32_t addr, const uint64_t imm)
+{
+	uint8_t temp, rex = opsize == 8 ? REX_W : 0;
+	rex |= mem != NOREG && mem >= 8 ? REX_B : 0;
+	const uint8_t immsize = opsize == 8 ? 4 : opsize;
+	assert(opsize != 8 || (int64_t)imm == (int32_t)imm);
+
 	if (text) {
-		array_addlit(text, 0xA3);
-		array_addlit(text, addr & 0xFF);
-		array_addlit(text, (addr >> 8) & 0xFF);
-		array_addlit(text, (addr >> 16) & 0xFF);
-		array_addlit(text, (addr >> 24) & 0xFF);
-		array_addlit(text, (addr >> 32) & 0xFF);
-		array_addlit(text, (addr >> 40) & 0xFF);
-		array_addlit(text, (addr >> 48) & 0xFF);
-		array_addlit(text, (addr >> 56) & 0xFF);
+		if (opsize == 2)
+			array_addlit(text, OP_SIZE_OVERRIDE);
+
+		if (rex)
+			array_addlit(text, rex);
+
+		array_addlit(text, opsize == 1 ? 0xC6 : 0xC7);
 	}
 
-	return 9;
-}
+	const size_t len = !!rex + (opsize == 2) + 1 + _memoperand(text, 0, mem, addr);
+	if (text) {
+		for (size_t k = 0; k < immsize; k++)
+			array_addlit(text, (imm >> 8*k) & 0xFF);
+	}
 
-#define MOVE_FROMREG 0
-#define MOVE_TOREG 1
+	return len + immsize;
+}
 
 static size_t
 _move_between_reg_and_memaddr_in_reg(struct data *const text, const enum reg reg, const enum reg mem, const uint8_t opsize, const bool dir)
 {
 	uint8_t temp, rex = opsize == 8 ? REX_W : 0;
-	rex |= (reg >= 8 ? REX_R : 0) | (mem >= 8 ? REX_B : 0);
+	rex |= (reg >= 8 ? REX_R : 0) | (mem >= 8 ? REX_B : 0) | rexbyte(opsize, reg);
+	// as a base, rsp and r12 need a SIB byte and rbp and r13 a displacement
+	const bool sib = (mem & 7) == RSP, disp = (mem & 7) == RBP;
 
 	if (text) {
 		if (opsize == 2)
@@ -256,11 +320,15 @@ _move_between_reg_and_memaddr_in_reg(struct data *const text, const enum reg reg
 
 		array_addlit(text, 0x88 + (opsize != 1) + 2*dir);
 
-		array_addlit(text, (MOD_INDIRECT << 6) | ((reg & 7) << 3) | (mem & 7));
+		array_addlit(text, ((disp ? MOD_DISP8 : MOD_INDIRECT) << 6) | ((reg & 7) << 3) | (mem & 7));
+		if (sib)
+			array_addlit(text, 0x24);
+		if (disp)
+			array_addlit(text, 0);
 	}
 
 	// 8 and 2 have a length of 3, but 4 and 1 have a length of 2
-	return !!rex + (opsize == 2) + 2;
+	return !!rex + (opsize == 2) + 2 + sib + disp;
 }
 
 static size_t
@@ -315,6 +383,7 @@ static size_t
 _move_between_reg_and_reg(struct data *const text, const enum reg dest, const enum reg src, const uint8_t opsize)
 {
 	uint8_t temp, rex = (src >= 8 ? REX_R : 0) | (dest >= 8 ? REX_B : 0) | (opsize == 8 ? REX_W : 0);
+	rex |= rexbyte(opsize, src) | rexbyte(opsize, dest);
 	if (text) {
 		if (opsize == 2)
 			array_addlit(text, OP_SIZE_OVERRIDE);
@@ -358,7 +427,7 @@ _move_between_reg_and_memaddr_in_reg_with_disp(struct data *const text, const en
 {
 	assert((reg & 7) != 4 && (mem & 7) != 4);
 	uint8_t temp, rex = opsize == 8 ? REX_W : 0;
-	rex |= (reg >= 8 ? REX_R : 0) | (mem >= 8 ? REX_B : 0);
+	rex |= (reg >= 8 ? REX_R : 0) | (mem >= 8 ? REX_B : 0) | rexbyte(opsize, reg);
 
 	if (text) {
 		if (opsize == 2)
@@ -425,13 +494,47 @@ mov_disp8_r8_m8(struct data *const text, const enum reg dest, const enum reg src
 	return _move_between_reg_and_memaddr_in_reg_with_disp(text, dest, src, disp, 1, MOVE_TOREG);
 }
 
+// 64-bit move between a register and [rbp + disp]
+static size_t
+_move_between_reg_and_frame(struct data *const text, const enum reg reg, const int32_t disp, const bool dir)
+{
+	uint8_t temp;
+	const bool small = -128 <= disp && disp <= 127;
+
+	if (text) {
+		array_addlit(text, REX_W | (reg >= 8 ? REX_R : 0));
+		array_addlit(text, 0x89 + 2*dir);
+		array_addlit(text, ((small ? MOD_DISP8 : MOD_DISP32) << 6) | ((reg & 7) << 3) | RBP);
+		array_addlit(text, disp & 0xFF);
+		if (!small) {
+			array_addlit(text, (disp >> 8) & 0xFF);
+			array_addlit(text, (disp >> 16) & 0xFF);
+			array_addlit(text, (disp >> 24) & 0xFF);
+		}
+	}
+
+	return small ? 4 : 7;
+}
+
+static size_t
+mov_frame_r64(struct data *const text, const int32_t disp, const enum reg src)
+{
+	return _move_between_reg_and_frame(text, src, disp, MOVE_FROMREG);
+}
+
+static size_t
+mov_r64_frame(struct data *const text, const enum reg dest, const int32_t disp)
+{
+	return _move_between_reg_and_frame(text, dest, disp, MOVE_TOREG);
+}
+
 static size_t
 _movezx_reg_to_reg(struct data *const text, const uint8_t destsize, const uint8_t srcsize, const enum reg dest, const enum reg src)
 {
 	assert(srcsize == 1 || srcsize == 2);
 	assert(destsize == 1 || destsize == 2 || destsize == 4 || destsize == 8);
 	uint8_t temp;
-	uint8_t rex = (destsize == 8 ? REX_W : 0) | (dest >= 8 ? REX_R : 0) | (src >= 8 ? REX_B : 0);
+	uint8_t rex = (destsize == 8 ? REX_W : 0) | (dest >= 8 ? REX_R : 0) | (src >= 8 ? REX_B : 0) | rexbyte(srcsize, src);
 	if (text) {
 		if (destsize == 2)
 			array_addlit(text, OP_SIZE_OVERRIDE);
@@ -441,7 +544,7 @@ _movezx_reg_to_reg(struct data *const text, const uint8_t destsize, const uint8_
 
 		array_addlit(text, 0x0F);
 		array_addlit(text, 0xB6 + (srcsize == 2));
-		array_addlit(text, (MOD_DIRECT << 6) | (dest << 3) | src);
+		array_addlit(text, (MOD_DIRECT << 6) | ((dest & 7) << 3) | (src & 7));
 	}
 
 	return 3 + !!rex + (destsize == 2);
@@ -483,9 +586,9 @@ lea_disp8(struct data *const text, const enum reg dest, const enum reg src, cons
 	uint8_t temp;
 	assert(src != 4);
 	if (text) {
-		array_addlit(text, REX_W);
+		array_addlit(text, REX_W | (dest >= 8 ? REX_R : 0) | (src >= 8 ? REX_B : 0));
 		array_addlit(text, 0x8d);
-		array_addlit(text, (MOD_DISP8 << 6) | (dest << 3) | src);
+		array_addlit(text, (MOD_DISP8 << 6) | ((dest & 7) << 3) | (src & 7));
 		array_addlit(text, disp);
 	}
 
@@ -497,9 +600,9 @@ add_r64_r64(struct data *const text, const enum reg dest, const enum reg src)
 {
 	uint8_t temp;
 	if (text) {
-		array_addlit(text, REX_W);
+		array_addlit(text, REX_W | (dest >= 8 ? REX_R : 0) | (src >= 8 ? REX_B : 0));
 		array_addlit(text, 0x03);
-		array_addlit(text, (MOD_DIRECT << 6) | (dest << 3) | src);
+		array_addlit(text, (MOD_DIRECT << 6) | ((dest & 7) << 3) | (src & 7));
 	}
 
 	return 3;
@@ -510,29 +613,18 @@ sub_r64_r64(struct data *const text, const enum reg dest, const enum reg src)
 {
 	uint8_t temp;
 	if (text) {
-		array_addlit(text, REX_W);
+		array_addlit(text, REX_W | (dest >= 8 ? REX_R : 0) | (src >= 8 ? REX_B : 0));
 		array_addlit(text, 0x2b);
-		array_addlit(text, (MOD_DIRECT << 6) | (dest << 3) | src);
+		array_addlit(text, (MOD_DIRECT << 6) | ((dest & 7) << 3) | (src & 7));
 	}
 
 	return 3;
 }
 
 static size_t
-sub_r64_imm(struct data *const text, const enum reg dest, int32_t imm)
+sub_r64_imm(struct data *const text, const enum reg dest, const int32_t imm)
 {
-	uint8_t temp;
-	if (text) {
-		array_addlit(text, REX_W);
-		array_addlit(text, 0x81);
-		array_addlit(text, (MOD_DIRECT << 6) | (5 << 3) | dest);
-		array_addlit(text, imm & 0xFF);
-		array_addlit(text, (imm >> 8) & 0xFF);
-		array_addlit(text, (imm >> 16) & 0xFF);
-		array_addlit(text, (imm >> 24) & 0xFF);
-	}
-
-	return 7;
+	return _arith_r64_imm(text, 5, dest, imm);
 }
 
 static size_t
@@ -540,6 +632,7 @@ _cmp_reg_to_reg(struct data *const text, const uint8_t size, const enum reg reg1
 {
 	uint8_t temp;
 	uint8_t rex = (size == 8 ? REX_W : 0) | (reg1 >= 8 ? REX_R : 0) | (reg2 >= 8 ? REX_B : 0);
+	rex |= rexbyte(size, reg1) | rexbyte(size, reg2);
 	if (text) {
 		if (size == 2)
 			array_addlit(text, OP_SIZE_OVERRIDE);
@@ -548,7 +641,7 @@ _cmp_reg_to_reg(struct data *const text, const uint8_t size, const enum reg reg1
 			array_addlit(text, rex);
 
 		array_addlit(text, 0x3A + (size != 1));
-		array_addlit(text, (MOD_DIRECT << 6) | (reg1 << 3) | reg2);
+		array_addlit(text, (MOD_DIRECT << 6) | ((reg1 & 7) << 3) | (reg2 & 7));
 	}
 
 	return 2 + !!rex + (size == 2);
@@ -578,83 +671,65 @@ cmp_r8_r8(struct data *const text, const enum reg reg1, const enum reg reg2)
 	return _cmp_reg_to_reg(text, 1, reg1, reg2);
 }
 
+// cmp of the low 'size' bytes of a register with an immediate, which is
+// sign-extended from a byte when that gives the same value
 static size_t
-cmp_r8_imm(struct data *const text, const enum reg reg, const uint8_t imm)
+_cmp_reg_to_imm(struct data *const text, const uint8_t size, const enum reg reg, const uint64_t imm)
 {
 	uint8_t temp;
+	const uint8_t rex = (size == 8 ? REX_W : 0) | (reg >= 8 ? REX_B : 0) | rexbyte(size, reg);
+	const int64_t val = size == 8 ? (int64_t)imm : size == 4 ? (int32_t)imm : size == 2 ? (int16_t)imm : (int8_t)imm;
+	const bool small = -128 <= val && val <= 127;
+	const uint8_t immsize = small ? 1 : size == 2 ? 2 : 4;
+	assert(val == (int32_t)val);
+
 	if (text) {
-		if (reg >= 8)
-			array_addlit(text, REX_B);
-		array_addlit(text, 0x80);
-		array_addlit(text, (MOD_DIRECT << 6) | (7 << 3) | (reg & 7));
-		array_addlit(text, imm);
-	}
+		if (size == 2)
+			array_addlit(text, OP_SIZE_OVERRIDE);
 
-	return 3 + !(reg < 8);
-}
+		if (rex)
+			array_addlit(text, rex);
 
-static size_t
-jng(struct data *const text, const int64_t offset)
-{
-	uint8_t temp;
-	if (-256 <= offset && offset <= 255) {
-		int8_t i = offset;
-		if (text) {
-			array_addlit(text, 0x7E);
-			array_addlit(text, i);
-		}
-		return 2;
-	} else {
-		die("unimplemented jng offet!");
+		array_addlit(text, size == 1 ? 0x80 : small ? 0x83 : 0x81);
+		array_addlit(text, (MOD_DIRECT << 6) | (7 << 3) | (reg & 7));
+		for (size_t k = 0; k < immsize; k++)
+			array_addlit(text, (val >> 8*k) & 0xFF);
 	}
 
-	return 0; // prevents warning
+	return 2 + !!rex + (size == 2) + immsize;
 }
 
 static size_t
-jg(struct data *const text, const int64_t offset)
+cmp_r8_imm(struct data *const text, const enum reg reg, const uint8_t imm)
 {
-	uint8_t temp;
-	if (-256 <= offset && offset <= 255) {
-		int8_t i = offset;
-		if (text) {
-			array_addlit(text, 0x7F);
-			array_addlit(text, i);
-		}
-		return 2;
-	} else {
-		die("unimplemented jg offet!");
-	}
-
-	return 0; // prevents warning
+	return _cmp_reg_to_imm(text, 1, reg, imm);
 }
 
 static size_t
-jne(struct data *const text, const int64_t offset)
+xor_r32_r32(struct data *const text, const enum reg dest, const enum reg src)
 {
 	uint8_t temp;
-	if (-256 <= offset && offset <= 255) {
-		int8_t i = offset;
-		if (text) {
-			array_addlit(text, 0x75);
-			array_addlit(text, i);
-		}
-		return 2;
-	} else {
-		die("unimplemented jne offet!");
+	const uint8_t rex = (src >= 8 ? REX_R : 0) | (dest >= 8 ? REX_B : 0);
+	if (text) {
+		if (rex)
+			array_addlit(text, rex);
+		array_addlit(text, 0x31);
+		array_addlit(text, (MOD_DIRECT << 6) | ((src & 7) << 3) | (dest & 7));
 	}
 
-	return 0; // prevents warning
+	return 2 + !!rex;
 }
 
+// Conditional jumps take the short form, with an 8-bit displacement, when
+// it reaches and the near one, with a 32-bit displacement, otherwise.
 static size_t
-je(struct data *const text, const int64_t offset)
+_jcc(struct data *const text, const uint8_t cc, const int64_t offset)
 {
 	uint8_t temp;
 	if (-128 <= offset && offset <= 127) {
 		int8_t i = offset;
 		if (text) {
-			array_addlit(text, 0x74);
+			array_addlit(text, 0x70 + cc);
 			array_add(text, i);
 		}
 		return 2;
@@ -662,7 +737,7 @@ je(struct data *const text, const int64_t offset)
 		int32_t i = offset;
 		if (text) {
 			array_addlit(text, 0x0F);
-			array_addlit(text, 0x84);
+			array_addlit(text, 0x80 + cc);
 			array_addlit(text, ((uint32_t) i) & 0xFF);
 			array_addlit(text, (((uint32_t) i) >> 8) & 0xFF);
 			array_addlit(text, (((uint32_t) i) >> 16) & 0xFF);
@@ -670,24 +745,49 @@ je(struct data *const text, const int64_t offset)
 		}
 		return 6;
 	} else {
-		die("unimplemented je offet!");
+		die("unimplemented jcc offset!");
 	}
 
 	return 0; // prevents warning
 }
 
+static size_t
+jng(struct data *const text, const int64_t offset)
+{
+	return _jcc(text, 0xE, offset);
+}
+
+static size_t
+jg(struct data *const text, const int64_t offset)
+{
+	return _jcc(text, 0xF, offset);
+}
+
+static size_t
+jne(struct data *const text, const int64_t offset)
+{
+	return _jcc(text, 0x5, offset);
+}
+
+static size_t
+je(struct data *const text, const int64_t offset)
+{
+	return _jcc(text, 0x4, offset);
+}
+
 static size_t
 sete_reg(struct data *const text, const enum reg reg)
 {
 	uint8_t temp;
 	if (text) {
-		if (reg >= 8) array_addlit(text, REX_B);
+		if (reg >= 8 || rexbyte(1, reg))
+			array_addlit(text, reg >= 8 ? REX_B : REX);
 		array_addlit(text, 0x0F);
 		array_addlit(text, 0x94);
 		array_addlit(text, (MOD_DIRECT << 6) | (reg & 7));
 	}
 
-	return 3 + !(reg < 8);
+	return 3 + (reg >= 8 || rexbyte(1, reg));
 }
 
 static size_t
@@ -695,29 +795,70 @@ setne_reg(struct data *const text, const enum reg reg)
 {
 	uint8_t temp;
 	if (text) {
-		if (reg >= 8) array_addlit(text, REX_B);
+		if (reg >= 8 || rexbyte(1, reg))
+			array_addlit(text, reg >= 8 ? REX_B : REX);
 		array_addlit(text, 0x0F);
 		array_addlit(text, 0x95);
 		array_addlit(text, (MOD_DIRECT << 6) | (reg & 7));
 	}
 
-	return 3 + !(reg < 8);
+	return 3 + (reg >= 8 || rexbyte(1, reg));
+}
+
+static size_t
+_cmov_r64_r64(struct data *const text, const uint8_t op, const enum reg dest, const enum reg src)
+{
+	uint8_t temp;
+	if (text) {
+		array_addlit(text, REX_W | (dest >= 8 ? REX_R : 0) | (src >= 8 ? REX_B : 0));
+		array_addlit(text, 0x0F);
+		array_addlit(text, op);
+		array_addlit(text, (MOD_DIRECT << 6) | ((dest & 7) << 3) | (src & 7));
+	}
+
+	return 4;
+}
+
+static size_t
+cmove_r64_r64(struct data *const text, const enum reg dest, const enum reg src)
+{
+	return _cmov_r64_r64(text, 0x44, dest, src);
+}
+
+static size_t
+cmovne_r64_r64(struct data *const text, const enum reg dest, const enum reg src)
+{
+	return _cmov_r64_r64(text, 0x45, dest, src);
+}
+
+static size_t
+jmp_rel32(struct data *const text, const int32_t offset)
+{
+	uint8_t temp;
+	if (text) {
+		array_addlit(text, 0xE9);
+		array_addlit(text, ((uint32_t) offset) & 0xFF);
+		array_addlit(text, (((uint32_t) offset) >> 8) & 0xFF);
+		array_addlit(text, (((uint32_t) offset) >> 16) & 0xFF);
+		array_addlit(text, (((uint32_t) offset) >> 24) & 0xFF);
+	}
+
+	return 5;
 }
 
 static size_t
 jmp(struct data *const text, const int64_t offset)
 {
 	uint8_t temp;
-	if (-2147483648 <= offset && offset <= 2147483647) {
-		int32_t i = offset;
+	if (-128 <= offset && offset <= 127) {
+		int8_t i = offset;
 		if (text) {
-			array_addlit(text, 0xE9);
-			array_addlit(text, ((uint32_t) i) & 0xFF);
-			array_addlit(text, (((uint32_t) i) >> 8) & 0xFF);
-			array_addlit(text, (((uint32_t) i) >> 16) & 0xFF);
-			array_addlit(text, (((uint32_t) i) >> 24) & 0xFF);
+			array_addlit(text, 0xEB);
+			array_add(text, i);
 		}
-		return 5;
+		return 2;
+	} else if (-2147483648 <= offset && offset <= 2147483647) {
+		return jmp_rel32(text, offset);
 	} else {
 		die("unimplemented jmp offet!");
 	}
@@ -770,6 +911,25 @@ push_r64(struct data *const text, const enum reg reg)
 	return _pushpop_r64(text, 0, reg);
 }
 
+// push of an immediate, sign-extended to 64 bits
+static size_t
+push_imm(struct data *const text, const int32_t imm)
+{
+	uint8_t temp;
+	const bool small = -128 <= imm && imm <= 127;
+	if (text) {
+		array_addlit(text, small ? 0x6A : 0x68);
+		array_addlit(text, imm & 0xFF);
+		if (!small) {
+			array_addlit(text, (imm >> 8) & 0xFF);
+			array_addlit(text, (imm >> 16) & 0xFF);
+			array_addlit(text, (imm >> 24) & 0xFF);
+		}
+	}
+
+	return small ? 2 : 5;
+}
+
 static size_t
 pop_r64(struct data *const text, const enum reg reg)
 {
@@ -787,6 +947,21 @@ const struct target x64_target = {
 
 #define NEXT ins++; assert(ins <= end);
 
+// a jump to a label of the procedure, and where it ended up
+struct jump {
+	uint64_t label;
+	size_t end; // from the start of the procedure
+	bool near; // whether a short displacement doesn't reach
+};
+
+// where the labels and jumps of a procedure go, from its start
+struct layout {
+	uint64_t *labels;
+	struct jump *jumps; // in order
+	size_t count; // of the jumps emitted so far
+	bool *folded; // immediates every use of which takes them as an operand
+};
+
 static size_t
 emitsyscall(struct data *const text, const uint8_t paramcount)
 {
@@ -821,82 +996,425 @@ emitsyscall(struct data *const text, const uint8_t paramcount)
 	return total;
 }
 
-size_t
-emitblock(struct data *const text, const struct iproc *const proc, const struct instr *const start, const struct instr *end, uint16_t active, uint16_t curi)
+// registers holding temporaries that are needed again after the call at i
+static uint16_t
+livearound(const struct iproc *const proc, const uint64_t i)
 {
-	const struct instr *ins = start ? start : proc->data;
-	end = end ? end : &proc->data[proc->len];
+	const uint64_t *const live = liveacross(proc, i);
+	const size_t words = proc->live.words;
+	uint16_t regs = 0;
 
-	uint64_t dest, src, size, count, label;
-	int64_t offset;
-	uint64_t localalloc = 0;
+	for (size_t t = bsnext(live, words, 0); t != BSNONE; t = bsnext(live, words, t + 1)) {
+		if (proc->temps.data[t].spill == SPILL_NONE)
+			regs |= 1 << proc->temps.data[t].reg;
+	}
+
+	return regs;
+}
+
+// The shortest move of an immediate into a register that leaves the flags
+// alone. Writing the lower half of a register clears the upper one.
+static size_t
+loadimm(struct data *const text, const enum reg dest, const uint64_t imm)
+{
+	if (imm <= UINT32_MAX)
+		return mov_r32_imm(text, dest, imm);
+	if ((int64_t)imm == (int32_t)imm)
+		return mov_r64_simm32(text, dest, imm);
+	return mov_r64_imm(text, dest, imm);
+}
+
+// The register holding temporary t where it is used. Spilled temporaries
+// are brought into one of the scratch registers, r12 and r13, first.
+static enum reg
+use(struct data *const text, const struct iproc *const proc, const uint64_t t, const enum reg scratch, size_t *const total)
+{
+	const struct temp *const temp = &proc->temps.data[t];
+
+	switch (temp->spill) {
+	case SPILL_NONE:
+		return temp->reg;
+	case SPILL_SLOT:
+		*total += mov_r64_frame(text, scratch, temp->disp);
+		return scratch;
+	case SPILL_REMAT:
+		assert(proc->data[temp->def + 1].op == IR_IMM);
+		*total += loadimm(text, scratch, proc->data[temp->def + 1].val);
+		return scratch;
+	}
+
+	die("x64 use: bad spill kind");
+	return 0;
+}
+
+static bool
+fits32(const uint64_t val)
+{
+	return (int64_t)val == (int32_t)val;
+}
+
+static bool
+isimm(const struct iproc *const proc, const uint64_t t)
+{
+	return proc->data[proc->temps.data[t].def + 1].op == IR_IMM;
+}
+
+// Whether the operand at j of the instruction at i can be the immediate val
+// itself instead of a register holding it. Absolute addresses and 64-bit
+// immediates are sign-extended from 32 bits.
+static bool
+takesimm(const struct iproc *const proc, const size_t i, const size_t j, const uint64_t val)
+{
+	const struct instr *const ins = &proc->data[i];
+
+	switch (ins->op) {
+	case IR_STORE:
+		if (j == i)
+			return proc->temps.data[ins[1].val].size < 8 || fits32(val);
+		return val <= INT32_MAX;
+	case IR_CALL:
+		return j > i && fits32(val);
+	case IR_ASSIGN:
+		break;
+	default:
+		return false;
+	}
+
+	switch (ins[1].op) {
+	case IR_COPY:
+		return true;
+	case IR_LOAD:
+		return val <= INT32_MAX;
+	case IR_ADD:
+	case IR_CEQ:
+		// only one of the operands can be an immediate
+		if (isimm(proc, ins[j == i + 1 ? 2 : 1].val))
+			return false;
+		return (ins[1].op == IR_CEQ && proc->temps.data[ins->val].size < 8) || fits32(val);
+	default:
+		return false;
+	}
+}
+
+// The immediates of the procedure that every use takes as an operand, so
+// that they never have to be put in a register.
+static bool *
+foldimms(const struct iproc *const proc)
+{
+	bool *const folded = xcalloc(proc->temps.len, sizeof(*folded));
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		if (proc->data[i].op == IR_ASSIGN && proc->data[i + 1].op == IR_IMM)
+			folded[proc->data[i].val] = true;
+	}
+
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i)) {
+		for (size_t j = i; j < i + inslen(proc, i); j++) {
+			const struct instr *const ins = &proc->data[j];
+			if (ins->valtype != VT_TEMP || ins->op == IR_ASSIGN || !folded[ins->val])
+				continue;
+
+			if (!takesimm(proc, i, j, proc->data[proc->temps.data[ins->val].def + 1].val))
+				folded[ins->val] = false;
+		}
+	}
+
+	return folded;
+}
 
+// Whether temporary t is an immediate that isn't in a register, either
+// because every use takes it as an operand or because it is rematerialized
+// anyway. If so, it goes in 'val'.
+static bool
+immval(const struct iproc *const proc, const struct layout *const layout, const uint64_t t, uint64_t *const val)
+{
+	const struct temp *const temp = &proc->temps.data[t];
+	if (!layout->folded[t] && temp->spill != SPILL_REMAT)
+		return false;
+
+	*val = proc->data[temp->def + 1].val;
+	return true;
+}
+
+// cmp of the operands of the comparison assigned at i, with one of them as
+// an immediate if it can be
+static size_t
+compare(struct data *const text, const struct iproc *const proc, const struct layout *const layout, const size_t i)
+{
+	const struct instr *const ins = &proc->data[i];
+	const uint8_t size = proc->temps.data[ins->val].size;
 	size_t total = 0;
-	if (!start) {
-		total += push_r64(text, RBP);
-		total += mov_r64_r64(text, RBP, RSP);
+	enum reg src, src2;
+	uint64_t val;
+
+	for (size_t j = 1; j <= 2; j++) {
+		if (immval(proc, layout, ins[j].val, &val) && takesimm(proc, i, i + j, val)) {
+			src = use(text, proc, ins[3 - j].val, R12, &total);
+			return total + _cmp_reg_to_imm(text, size, src, val);
+		}
 	}
 
-	while (ins < end) {
-		curi++;
-		for (size_t j = 0; j < proc->temps.len; j++) {
-			if ((active & (1 << j)) && proc->temps.data[j].end == curi - 1)
-				active &= ~(1 << proc->temps.data[j].reg);
+	src = use(text, proc, ins[1].val, R12, &total);
+	src2 = use(text, proc, ins[2].val, R13, &total);
+	switch (size) {
+	case 8:
+		return total + cmp_r64_r64(text, src, src2);
+	case 4:
+		return total + cmp_r32_r32(text, src, src2);
+	case 2:
+		return total + cmp_r16_r16(text, src, src2);
+	case 1:
+		return total + cmp_r8_r8(text, src, src2);
+	}
 
-			if (!(active & (1 << j)) && proc->temps.data[j].start == curi)
-				active |= 1 << proc->temps.data[j].reg;
+	die("x64 compare: bad size");
+	return 0;
+}
+
+// push of the argument at j of the call at i
+static size_t
+pusharg(struct data *const text, const struct iproc *const proc, const struct layout *const layout, const size_t i, const size_t j)
+{
+	size_t total = 0;
+	uint64_t imm;
+
+	if (immval(proc, layout, proc->data[j].val, &imm) && takesimm(proc, i, j, imm))
+		return push_imm(text, imm);
+
+	const enum reg src = use(text, proc, proc->data[j].val, R12, &total);
+	return total + push_r64(text, src);
+}
+
+// Whether the address of a local is used for anything but loading from and
+// storing to it, other than as the place for the result of the call at i.
+static bool
+localescapes(const struct iproc *const proc, const size_t i)
+{
+	bool *const local = xcalloc(proc->temps.len, sizeof(*local));
+	bool escapes = false;
+
+	for (size_t j = 0; j < proc->len; j += inslen(proc, j)) {
+		if (proc->data[j].op == IR_ASSIGN && proc->data[j + 1].op == IR_ALLOC)
+			local[proc->data[j].val] = true;
+	}
+
+	for (size_t j = 0; j < proc->len && !escapes; j += inslen(proc, j)) {
+		const struct instr *const ins = &proc->data[j];
+		for (size_t k = j; k < j + inslen(proc, j); k++) {
+			if (proc->data[k].valtype != VT_TEMP || !local[proc->data[k].val])
+				continue;
+
+			const bool def = k == j && ins->op == IR_ASSIGN;
+			const bool load = k == j + 1 && ins->op == IR_ASSIGN && ins[1].op == IR_LOAD;
+			const bool store = k == j + 1 && ins->op == IR_STORE;
+			if (!def && !load && !store && k != i + 1)
+				escapes = true;
 		}
+	}
+
+	free(local);
+	return escapes;
+}
+
+// Whether the call at i can jump to the callee instead, reusing the frame
+// this procedure was called with. The call has to be the last thing it
+// does, the callee has to take as many arguments so that whoever called
+// this procedure pops the right number, and the place the callee puts its
+// result in can't be in the frame that is going away. Neither can a local
+// whose address the callee may have been given, since the frame is gone
+// before the callee runs. main was never called, so there is nothing to
+// return to.
+static bool
+tailcall(const struct iproc *const proc, const size_t i)
+{
+	const struct iproc *const callee = &toplevel.code.data[proc->data[i].val];
+
+	if (!returnsafter(proc, i) || !callee->len || callee->nargs != proc->nargs || slice_cmplit(&proc->s, "main") == 0 || localescapes(proc, i))
+		return false;
+
+	// the place for the result comes first, and is last for the callee
+	const struct instr *const def = &proc->data[proc->temps.data[proc->data[i + 1].val].def];
+	if (def->op == IR_ASSIGN && def[1].op == IR_IN && def[1].val == proc->nargs - 1)
+		return true;
+
+	for (size_t j = 0; j < callee->len; j += inslen(callee, j)) {
+		const struct instr *const ins = &callee->data[j];
+		if (ins->op == IR_ASSIGN && ins[1].op == IR_IN && ins[1].val == callee->nargs - 1)
+			return false;
+	}
+
+	return true;
+}
+
+// Whether the comparison or negation assigned at i does nothing but decide
+// the branch or select right after it, possibly through more negations, so
+// that it can test the flags it sets instead of a register holding it.
+static bool
+fused(const struct iproc *const proc, const size_t i)
+{
+	const struct instr *const ins = &proc->data[i];
+	const size_t next = i + inslen(proc, i);
+	if (ins->op != IR_ASSIGN || (ins[1].op != IR_CEQ && ins[1].op != IR_NOT) || next + 1 >= proc->len)
+		return false;
+
+	// an interval covering nothing but the definition and the next
+	// instruction means the temporary is used nowhere else
+	const struct temp *const temp = &proc->temps.data[ins->val];
+	const struct instr *const user = &proc->data[next];
+	if (temp->start != i || temp->end != next + 1 || user[1].val != ins->val)
+		return false;
+
+	return user->op == IR_CONDJUMP || (user->op == IR_ASSIGN && user[1].op == IR_SELECT) || (user->op == IR_ASSIGN && user[1].op == IR_NOT && fused(proc, next));
+}
+
+// Set the flags for a branch or select on temporary t. Negations fused into
+// it just flip which way it goes, and a fused comparison is done right here.
+// Returns whether t is false exactly when the flags say equal.
+static bool
+condtest(struct data *const text, const struct iproc *const proc, const struct layout *const layout, uint64_t t, size_t *const total)
+{
+	bool negate = false;
+	const struct instr *def = &proc->data[proc->temps.data[t].def];
+	enum reg src;
+
+	while (def[1].op == IR_NOT && fused(proc, def - proc->data)) {
+		negate = !negate;
+		t = def[1].val;
+		def = &proc->data[proc->temps.data[t].def];
+	}
+
+	if (def[1].op == IR_CEQ && fused(proc, def - proc->data)) {
+		*total += compare(text, proc, layout, def - proc->data);
+		return negate;
+	}
+
+	src = use(text, proc, t, R12, total);
+	*total += cmp_r8_imm(text, src, 0);
+	return !negate;
+}
+
+// Emit a jump to label at offset 'at' of the procedure, in the form the
+// layout says it needs. Without any text, this only notes where it ends,
+// and the labels may not be where they will end up yet.
+static size_t
+jump(struct data *const text, struct layout *const layout, size_t (*const jcc)(struct data *const, const int64_t), const uint64_t label, const size_t at)
+{
+	struct jump *const j = &layout->jumps[layout->count++];
+	const size_t size = j->near ? jcc(NULL, INT32_MAX) : jcc(NULL, 0);
+
+	j->label = label;
+	j->end = at + size;
+	if (!text)
+		return size;
+
+	// displacements are from the end of the jump
+	const size_t len = jcc(text, (int64_t)layout->labels[label] - (int64_t)j->end);
+	assert(len == size);
+	return len;
+}
+
+static size_t
+emitblock(struct data *const text, const struct iproc *const proc, struct layout *const layout)
+{
+	const struct instr *ins = proc->data;
+	const struct instr *const end = &proc->data[proc->len];
+
+	uint64_t dest, src, src2, size, count, label, imm, addr;
+	size_t pos, j;
+	const struct temp *def;
+	uint16_t live;
+	int64_t offset;
+	size_t (*jcc)(struct data *const, const int64_t);
+	bool equal;
+
+	size_t total = 0;
+	total += push_r64(text, RBP);
+	total += mov_r64_r64(text, RBP, RSP);
+	if (proc->frame)
+		total += sub_r64_imm(text, RSP, proc->frame);
+
+	while (ins < end) {
 		switch (ins->op) {
 		case IR_JUMP:
 			assert(ins->valtype == VT_LABEL);
-			label = ins->val;
-			if (ins < &proc->data[proc->labels.data[label]]) {
-				total += jmp(text, emitblock(NULL, proc, ins + 1, &proc->data[proc->labels.data[label]], active, curi));
-			} else {
-				total += jmp(text, emitblock(NULL, proc, start, &proc->data[proc->labels.data[label]], 0, 0) - total - 5);
-			}
+			total += jump(text, layout, jmp, ins->val, total);
 			NEXT;
 			break;
 		case IR_CONDJUMP:
 			assert(ins->valtype == VT_LABEL);
-			curi++;
 			label = ins->val;
 			NEXT;
 			assert(ins->op == IR_EXTRA);
 			assert(ins->valtype == VT_TEMP);
-			total += cmp_r8_imm(text, proc->temps.data[ins->val].reg, 0);
-			if (ins < &proc->data[proc->labels.data[label]]) {
-				total += je(text, emitblock(NULL, proc, ins + 1, &proc->data[proc->labels.data[label]], active, curi));
-			} else {
-				total += je(text, emitblock(NULL, proc, start, &proc->data[proc->labels.data[label]], 0, 0) - total - 2); // FIXME: 2 = size of short jump
-			}
+			// the branch is taken when the condition is false
+			jcc = condtest(text, proc, layout, ins->val, &total) ? je : jne;
+			total += jump(text, layout, jcc, label, total);
 			NEXT;
 			break;
 		case IR_RETURN:
 			assert(ins->valtype == VT_EMPTY);
-			total += add_r64_imm(text, RSP, localalloc);
+			total += mov_r64_r64(text, RSP, RBP);
 			total += pop_r64(text, RBP);
 			total += ret(text);
 			NEXT;
 			break;
 		case IR_STORE:
 			assert(ins->valtype == VT_TEMP);
-			src = proc->temps.data[ins->val].reg;
+			pos = ins - proc->data;
+			size = proc->temps.data[ins[1].val].size;
+			// the value, the address or both may be immediates
+			if (immval(proc, layout, ins[1].val, &addr) && takesimm(proc, pos, pos + 1, addr)) {
+				if (immval(proc, layout, ins->val, &imm) && takesimm(proc, pos, pos, imm)) {
+					total += _move_imm_to_mem(text, size, NOREG, addr, imm);
+				} else {
+					src = use(text, proc, ins->val, R12, &total);
+					switch (size) {
+					case 8:
+						total += mov_m64_r64(text, addr, src);
+						break;
+					case 4:
+						total += mov_m32_r32(text, addr, src);
+						break;
+					case 2:
+						total += mov_m16_r16(text, addr, src);
+						break;
+					case 1:
+						total += mov_m8_r8(text, addr, src);
+						break;
+					default:
+						die("x64: emitblock: IR_STORE: bad size");
+					}
+				}
+				NEXT;
+				NEXT;
+				break;
+			}
+
+			if (immval(proc, layout, ins->val, &imm) && takesimm(proc, pos, pos, imm)) {
+				dest = use(text, proc, ins[1].val, R13, &total);
+				total += _move_imm_to_mem(text, size, dest, 0, imm);
+				NEXT;
+				NEXT;
+				break;
+			}
+
+			src = use(text, proc, ins->val, R12, &total);
 			NEXT;
 			assert(ins->op == IR_EXTRA);
 			assert(ins->valtype == VT_TEMP);
+			dest = use(text, proc, ins->val, R13, &total);
 			switch (proc->temps.data[ins->val].size) {
 			case 8:
-				total += mov_mr64_r64(text, proc->temps.data[ins->val].reg, src);
+				total += mov_mr64_r64(text, dest, src);
 				break;
 			case 4:
-				total += mov_mr32_r32(text, proc->temps.data[ins->val].reg, src);
+				total += mov_mr32_r32(text, dest, src);
 				break;
 			case 2:
-				total += mov_mr16_r16(text, proc->temps.data[ins->val].reg, src);
+				total += mov_mr16_r16(text, dest, src);
 				break;
 			case 1:
-				total += mov_mr8_r8(text, proc->temps.data[ins->val].reg, src);
+				total += mov_mr8_r8(text, dest, src);
 				break;
 			default:
 				die("x64: emitblock: IR_STORE: bad size");
@@ -905,64 +1423,110 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 			break;
 		case IR_ASSIGN:
 			assert(ins->valtype == VT_TEMP);
-			dest = proc->temps.data[ins->val].reg;
-			size = proc->temps.data[ins->val].size;
+			def = &proc->temps.data[ins->val];
+			dest = def->spill == SPILL_NONE ? def->reg : R12;
+			size = def->size;
+
+			// rematerialized temporaries, parameters that stay where
+			// the caller put them, tests the branch after them does
+			// itself and immediates that are only ever operands don't
+			// need to be computed here at all
+			if (def->spill == SPILL_REMAT || (def->spill == SPILL_SLOT && ins[1].op == IR_IN) || fused(proc, ins - proc->data) || layout->folded[ins->val]) {
+				ins += inslen(proc, ins - proc->data);
+				break;
+			}
+
 			NEXT;
 
 			switch (ins->op) {
 			case IR_NOT:
 				assert(ins->valtype == VT_TEMP);
 				assert(size == 1);
-				total += cmp_r8_imm(text, proc->temps.data[ins->val].reg, 1);
+				src = use(text, proc, ins->val, R12, &total);
+				total += cmp_r8_imm(text, src, 1);
 				total += setne_reg(text, dest);
 				NEXT;
 				break;
 			case IR_CEQ:
 				assert(ins->valtype == VT_TEMP);
-				src = proc->temps.data[ins->val].reg;
+				total += compare(text, proc, layout, ins - 1 - proc->data);
 				NEXT;
 				assert(ins->op == IR_EXTRA);
 				assert(ins->valtype == VT_TEMP);
-				switch (size) {
-				case 8:
-					total += cmp_r64_r64(text, src, proc->temps.data[ins->val].reg);
-					break;
-				case 4:
-					total += cmp_r32_r32(text, src, proc->temps.data[ins->val].reg);
-					break;
-				case 2:
-					total += cmp_r16_r16(text, src, proc->temps.data[ins->val].reg);
-					break;
-				case 1:
-					total += cmp_r8_r8(text, src, proc->temps.data[ins->val].reg);
-					break;
-				default:
-					die("x64 emitblock: IR_CEQ: bad size");
-				}
 				total += sete_reg(text, dest);
 				NEXT;
 				break;
+			case IR_SELECT:
+				assert(ins->valtype == VT_TEMP);
+				equal = condtest(text, proc, layout, ins->val, &total);
+				NEXT;
+				assert(ins->op == IR_EXTRA);
+				assert(ins->valtype == VT_TEMP);
+				src = use(text, proc, ins->val, R12, &total);
+				NEXT;
+				assert(ins->op == IR_EXTRA);
+				assert(ins->valtype == VT_TEMP);
+				src2 = use(text, proc, ins->val, R13, &total);
+				// moves leave the flags alone, and whichever value
+				// is already in dest is the one that may be replaced
+				if (dest == src2) {
+					total += (equal ? cmovne_r64_r64 : cmove_r64_r64)(text, dest, src);
+				} else {
+					if (dest != src)
+						total += mov_r64_r64(text, dest, src);
+					total += (equal ? cmove_r64_r64 : cmovne_r64_r64)(text, dest, src2);
+				}
+				NEXT;
+				break;
 			case IR_ADD:
 				assert(ins->valtype == VT_TEMP);
-				total += mov_r64_r64(text, dest, proc->temps.data[ins->val].reg);
+				// either operand may be an immediate, added to the
+				// other one
+				pos = ins - 1 - proc->data;
+				for (j = 0; j < 2; j++) {
+					if (immval(proc, layout, ins[j].val, &imm) && takesimm(proc, pos, pos + 1 + j, imm))
+						break;
+				}
+
+				if (j < 2) {
+					src = use(text, proc, ins[1 - j].val, R12, &total);
+					if (dest != src)
+						total += mov_r64_r64(text, dest, src);
+					total += add_r64_imm(text, dest, imm);
+					NEXT;
+					NEXT;
+					break;
+				}
+
+				src = use(text, proc, ins->val, R12, &total);
 				NEXT;
 				assert(ins->op == IR_EXTRA);
 				assert(ins->valtype == VT_TEMP);
-				total += add_r64_r64(text, dest, proc->temps.data[ins->val].reg);
+				src2 = use(text, proc, ins->val, R13, &total);
+				// the result may have taken over the register of
+				// either operand, and adding is commutative
+				if (dest == src2) {
+					total += add_r64_r64(text, dest, src);
+				} else {
+					if (dest != src)
+						total += mov_r64_r64(text, dest, src);
+					total += add_r64_r64(text, dest, src2);
+				}
 				NEXT;
 				break;
 			case IR_ZEXT:
 				assert(ins->valtype == VT_TEMP);
+				src = use(text, proc, ins->val, R12, &total);
 				if (size == 8) {
 					switch (proc->temps.data[ins->val].size) {
 					case 1:
-						total += movzx_r64_r8(text, dest, proc->temps.data[ins->val].reg);
+						total += movzx_r64_r8(text, dest, src);
 						break;
 					case 2:
-						total += movzx_r64_r16(text, dest, proc->temps.data[ins->val].reg);
+						total += movzx_r64_r16(text, dest, src);
 						break;
 					case 4: // upper 32-bits get cleared automatically in x64
-						total += mov_r32_r32(text, dest, proc->temps.data[ins->val].reg);
+						total += mov_r32_r32(text, dest, src);
 						break;
 					default:
 						die("x64 emitblock: IR_ZEXT size 8: bad size");
@@ -970,13 +1534,13 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 				} else if (size == 4) {
 					switch (proc->temps.data[ins->val].size) {
 					case 1:
-						total += movzx_r32_r8(text, dest, proc->temps.data[ins->val].reg);
+						total += movzx_r32_r8(text, dest, src);
 						break;
 					case 2:
-						total += movzx_r32_r16(text, dest, proc->temps.data[ins->val].reg);
+						total += movzx_r32_r16(text, dest, src);
 						break;
 					case 4: // upper 32-bits get cleared automatically in x64
-						total += mov_r32_r32(text, dest, proc->temps.data[ins->val].reg);
+						total += mov_r32_r32(text, dest, src);
 						break;
 					default:
 						die("x64 emitblock: IR_ZEXT size 4: bad size");
@@ -984,7 +1548,7 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 				} else if (size == 2) {
 					switch (proc->temps.data[ins->val].size) {
 					case 1:
-						total += movzx_r16_r8(text, dest, proc->temps.data[ins->val].reg);
+						total += movzx_r16_r8(text, dest, src);
 						break;
 					default:
 						die("x64 emitblock: IR_ZEXT size 2: bad size");
@@ -994,27 +1558,64 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 				break;
 			case IR_IMM:
 				assert(ins->valtype == VT_IMM);
-				total += mov_r64_imm(text, dest, ins->val);
+				// nothing is waiting for the flags here
+				total += ins->val ? loadimm(text, dest, ins->val) : xor_r32_r32(text, dest, dest);
+				NEXT;
+				break;
+			case IR_COPY:
+				assert(ins->valtype == VT_TEMP);
+				if (immval(proc, layout, ins->val, &imm)) {
+					total += loadimm(text, dest, imm);
+					NEXT;
+					break;
+				}
+
+				src = use(text, proc, ins->val, R12, &total);
+				if (dest != src)
+					total += mov_r64_r64(text, dest, src);
 				NEXT;
 				break;
 			case IR_IN:
-				total += mov_disp8_r64_m64(text, dest, RBP, 8*ins->val + 16);
+				total += mov_r64_frame(text, dest, 8*ins->val + 16);
 				NEXT;
 				break;
 			case IR_LOAD:
 				assert(ins->valtype == VT_TEMP);
+				pos = ins - 1 - proc->data;
+				if (immval(proc, layout, ins->val, &addr) && takesimm(proc, pos, pos + 1, addr)) {
+					switch (size) {
+					case 8:
+						total += mov_r64_m64(text, dest, addr);
+						break;
+					case 4:
+						total += mov_r32_m32(text, dest, addr);
+						break;
+					case 2:
+						total += mov_r16_m16(text, dest, addr);
+						break;
+					case 1:
+						total += mov_r8_m8(text, dest, addr);
+						break;
+					default:
+						die("x64 emitblock: IR_LOAD: bad size");
+					}
+					NEXT;
+					break;
+				}
+
+				src = use(text, proc, ins->val, R12, &total);
 				switch (size) {
 				case 8:
-					total += mov_r64_mr64(text, dest, proc->temps.data[ins->val].reg);
+					total += mov_r64_mr64(text, dest, src);
 					break;
 				case 4:
-					total += mov_r32_mr32(text, dest, proc->temps.data[ins->val].reg);
+					total += mov_r32_mr32(text, dest, src);
 					break;
 				case 2:
-					total += mov_r16_mr16(text, dest, proc->temps.data[ins->val].reg);
+					total += mov_r16_mr16(text, dest, src);
 					break;
 				case 1:
-					total += mov_r8_mr8(text, dest, proc->temps.data[ins->val].reg);
+					total += mov_r8_mr8(text, dest, src);
 					break;
 				default:
 					die("x64 emitblock: IR_LOAD: bad size");
@@ -1023,22 +1624,56 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 				break;
 			case IR_ALLOC:
 				assert(ins->valtype == VT_IMM);
-				total += mov_r64_r64(text, dest, RSP);
 				total += sub_r64_imm(text, RSP, 8); // FIXME: hardcoding
-				localalloc += 8;
+				total += mov_r64_r64(text, dest, RSP);
 				NEXT;
 				break;
 			default:
 				die("x64 emitblock: unhandled assign instruction");
 			}
+
+			if (def->spill == SPILL_SLOT)
+				total += mov_frame_r64(text, def->disp, dest);
 			break;
 		case IR_CALL:
 			assert(ins->valtype == VT_FUNC);
 			count = 0;
 			dest = ins->val;
+			pos = ins - proc->data;
+			if (tailcall(proc, ins - proc->data)) {
+				NEXT;
+				// every argument is read before any of the slots
+				// they go to is written, since spilled parameters
+				// live in those slots
+				while (ins < end && ins->op == IR_CALLARG) {
+					assert(ins->valtype == VT_TEMP);
+					total += pusharg(text, proc, layout, pos, ins - proc->data);
+					count++;
+					NEXT;
+				}
+
+				for (size_t i = 0; i < count; i++) {
+					total += pop_r64(text, R12);
+					total += mov_frame_r64(text, 16 + 8*i, R12);
+				}
+
+				total += mov_r64_r64(text, RSP, RBP);
+				total += pop_r64(text, RBP);
+				// like calls, these always take the near form, as
+				// procedures aren't relaxed against each other
+				offset = -(proc->addr + total - toplevel.code.data[dest].addr + jmp_rel32(NULL, 0));
+				total += jmp_rel32(text, offset);
+
+				// the return is never reached
+				if (ins < end && (ins->op == IR_RETURN || ins->op == IR_JUMP))
+					NEXT;
+				break;
+			}
+
+			live = livearound(proc, ins - proc->data);
 
 			for (int i = 0; i < 16; i++) {
-				if (active & (1 << i)) {
+				if (live & (1 << i)) {
 					total += push_r64(text, i);
 				}
 			}
@@ -1047,7 +1682,7 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 			while (ins < end && ins->op == IR_CALLARG) {
 				assert(ins->valtype == VT_TEMP);
 				count++;
-				total += push_r64(text, proc->temps.data[ins->val].reg);
+				total += pusharg(text, proc, layout, pos, ins - proc->data);
 				NEXT;
 			}
 
@@ -1057,13 +1692,14 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 			// FIXME: this won't work with non-64-bit things
 			total += add_r64_imm(text, RSP, 8*count);
 			for (int i = 15; i >= 0; i--) {
-				if (active & (1 << i)) {
+				if (live & (1 << i)) {
 					total += pop_r64(text, i);
 				}
 			}
 			break;
 		case IR_LABEL:
 			assert(ins->valtype == VT_LABEL);
+			layout->labels[ins->val] = total;
 			NEXT;
 			break;
 		case IR_IMM:
@@ -1077,8 +1713,44 @@ emitblock(struct data *const text, const struct iproc *const proc, const struct
 	return total;
 }
 
+// Branch relaxation: every jump starts out short, and the procedure is laid
+// out without emitting anything to see which of them don't reach their
+// label. Those become near jumps, which moves everything after them, so
+// this is repeated until all of them reach. Jumps only ever get longer,
+// and one that needed to be near never gets close enough to be short again,
+// which is what makes this end. The last layout is then the one emitted.
 size_t
 emitproc(struct data *const text, const struct iproc *const proc)
 {
-	return emitblock(text, proc, NULL, NULL, 0, 0);
+	size_t count = 0;
+	for (size_t i = 0; i < proc->len; i += inslen(proc, i))
+		count += proc->data[i].op == IR_JUMP || proc->data[i].op == IR_CONDJUMP;
+
+	struct layout layout = {
+		.labels = xmalloc(proc->labels.len * sizeof(*layout.labels)),
+		.jumps = xcalloc(count ? count : 1, sizeof(*layout.jumps)),
+		.folded = foldimms(proc),
+	};
+	bool widened = true;
+
+	while (widened) {
+		widened = false;
+		layout.count = 0;
+		emitblock(NULL, proc, &layout);
+
+		for (size_t j = 0; j < layout.count; j++) {
+			struct jump *const jump = &layout.jumps[j];
+			const int64_t offset = (int64_t)layout.labels[jump->label] - (int64_t)jump->end;
+			if (!jump->near && (offset < -128 || offset > 127))
+				widened = jump->near = true;
+		}
+	}
+
+	layout.count = 0;
+	const size_t total = emitblock(text, proc, &layout);
+
+	free(layout.folded);
+	free(layout.jumps);
+	free(layout.labels);
+	return total;
 }